@@ -1,6 +1,5 @@
 #pragma once
 #include <string>
-#include <random>
 #include <sstream>
 #include <map>
 #include <type_traits>
@@ -9,11 +8,33 @@
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "transposition.h"
+#include "simd.h"
+#include "profile.h"
+#include "checkpoint.h"
+#include "rng.h"
 #include <fstream>
 #include <cmath>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
 
-#define TUPLE4_SIZE 8
-#define TUPLE6_SIZE 4
+/**
+ * the cells where the environment may place the next tile, indexed by the last opcode
+ * (the edge opposite to the sliding direction)
+ */
+inline const std::array<std::array<int, 4>, 4>& spawn_space() {
+	static const std::array<std::array<int, 4>, 4> space = {{
+		{ {12,13,14,15} },
+		{ {0,4,8,12} },
+		{ {0,1,2,3} },
+		{ {3,7,11,15} }
+	}};
+	return space;
+}
 
 class agent {
 public:
@@ -50,13 +71,21 @@ protected:
 
 class random_agent : public agent {
 public:
-	random_agent(const std::string& args = "") : agent(args) {
+	random_agent(const std::string& args = "") : agent(args), seed(0) {
 		if (meta.find("seed") != meta.end())
-			engine.seed(int(meta["seed"]));
+			seed = std::stoull(property("seed"));
+		engine.seed(seed);
 	}
 	virtual ~random_agent() {}
+
+	/**
+	 * switch to the k-th random stream of the seed (e.g., the k-th episode), which does not
+	 * depend on the streams used before
+	 */
+	void fork(uint64_t k) { engine.seed(seed, k); }
 protected:
-	std::default_random_engine engine;
+	uint64_t seed;
+	rng::xoshiro256 engine;
 };
 
 
@@ -79,216 +108,476 @@ protected:
 class weight_agent : public agent {
 public:
 weight_agent(const std::string& args = "") : agent(args),
-    tuple4({{ 
-        {{0,1,2,3}},
-        {{3,7,11,15}},
-        {{15,14,13,12}},
-        {{12,8,4,0}},
-        {{1,5,9,13}},
-        {{7,6,5,4}},
-        {{14,10,6,2}},
-        {{8,9,10,11}},
-    }}),
-    tuple6({{
-        {{8,5,2,4,1,0}},
-        {{1,6,11,2,7,3}},
-        {{7,10,13,11,14,15}},
-        {{14,9,4,13,8,12}},
-    }})
+    isa(simd::select(meta.find("simd") != meta.end() ? property("simd") : "")), sym(0),
+    shared(std::make_shared<std::vector<weight>>()), net(*shared)
     {
+		if (meta.find("pages") != meta.end()) // pass pages=4k|thp|hugetlb to choose the pages of the tables
+			weight::backend().pages = weight::parse_paging(property("pages"));
+		if (meta.find("prefault") != meta.end()) // pass prefault=1 to touch every page of the tables up front
+			weight::backend().prefault = int(meta["prefault"]) != 0;
+		if (meta.find("tuples") != meta.end()) // pass tuples=0,1,2,3,4,5;4,5,6,7,8,9 (and iso=4|8 to share a table among isomorphic tuples)
+			init_isomorphic(meta.find("iso") != meta.end() ? unsigned(meta["iso"]) : 1, property("tuples"));
+		else if (meta.find("iso") != meta.end()) // pass iso=1|4|8 (and patterns=...) for the isomorphic network
+			init_isomorphic(meta["iso"], meta.find("patterns") != meta.end() ? property("patterns") : "0,1,2,3;1,5,9,13;8,5,2,4,1,0");
+		else
+			init_fixed();
 		if (meta.find("init") != meta.end()) // pass init=... to initialize the weight
 			init_weights(meta["init"]);
 		if (meta.find("load") != meta.end()) // pass load=... to load from a specific file
 			load_weights(meta["load"]);
+		if (meta.find("checkpoint") != meta.end() && meta.find("save") != meta.end()) // pass checkpoint=N or Ts to save every N games or T seconds
+			saver = std::make_shared<checkpoint>(property("save"), property("checkpoint"));
+		if (meta.find("tc") != meta.end() && int(meta["tc"])) // pass tc=1 to scale the step of every weight by its temporal coherence
+			for (weight& w : net) w.track();
+		if (meta.find("quantize") != meta.end()) // pass quantize=fp16|int16 to convert the tables for inference
+			quantize_weights(weight::parse(property("quantize")));
+	}
+	/**
+	 * a copy shares the weight tables of the original (e.g., for parallel self-play)
+	 * only the original saves the weights on exit
+	 */
+	weight_agent(const weight_agent& w) : agent(w),
+		isa(w.isa), sym(w.sym), tuples(w.tuples), runs(w.runs), lanes(w.lanes), scale(w.scale), features(w.features), index(w.index), shared(w.shared), net(*shared), saver(w.saver) {
+		meta.erase("save");
 	}
 	virtual ~weight_agent() {
+		if (saver) saver->wait();
 		if (meta.find("save") != meta.end()) // pass save=... to save to a specific file
 			save_weights(meta["save"]);
 	}
 
-protected:
-	virtual void init_weights(const std::string& info) {
-        uint32_t n=TUPLE4_SIZE>>2;
-        for(uint32_t i=0;i<n;i++){
-            net.emplace_back(65536);// create an empty weight table with size 65536
-        }
-        n=TUPLE6_SIZE>>2;
-        for(uint32_t i=0;i<n;i++){
-            net.emplace_back(16777216);
-        }
-        
-        // now net.size() == 2; net[0].size() == 65536; net[1].size() == 65536 
-    }
-	virtual void load_weights(const std::string& path) {
-		std::ifstream in(path, std::ios::in | std::ios::binary);
-		if (!in.is_open()) std::exit(-1);
-		uint32_t size;
-		in.read(reinterpret_cast<char*>(&size), sizeof(size));
-		net.resize(size);
-		for (weight& w : net) in >> w;
-		in.close();
+	/**
+	 * take a checkpoint of the weights if one is due, the copies share the checkpoints of the original,
+	 * the moves of the episode measure the throughput while a checkpoint is written
+	 */
+	virtual void close_episode(const std::string& flag = "") { close_episode(flag, 0); }
+	void close_episode(const std::string& flag, size_t moves) {
+		if (saver && saver->due(moves)) saver->take(net, sym, tuples);
 	}
-	virtual void save_weights(const std::string& path) {
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
-		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
-		out.close();
+
+	/**
+	 * the checkpoints since the last report, or nothing if checkpoints are not taken
+	 */
+	void report(std::ostream& out) {
+		if (saver) saver->report(out);
 	}
-    
-public:
-    float V_function(const board& board,bool storefeatures){
-        float value=0;
-        if(net.size()==0)return float(rand());
-        for(uint32_t i=0;i<TUPLE4_SIZE;i++){
-            uint32_t feature=0;
-            for(int pos : tuple4[i]){
-                feature=(feature<<4);
-                feature+=board(pos);
-            }
-            uint32_t j=i>>2; 
-            value+=net[j][feature];
+	bool checkpointing() const { return bool(saver); }
 
-            if(storefeatures)
-                features4[i]=feature;
+protected:
+    /**
+     * set up the fixed network: eight 4-tuples (the four rotations of an edge line and of an inner line)
+     * and four 6-tuples (the rotations of one pattern), the four rotations of a tuple share a table
+     */
+    void init_fixed() {
+        static const int cells[12][6] = {
+            {0,1,2,3}, {3,7,11,15}, {15,14,13,12}, {12,8,4,0},
+            {1,5,9,13}, {7,6,5,4}, {14,10,6,2}, {8,9,10,11},
+            {8,5,2,4,1,0}, {1,6,11,2,7,3}, {7,10,13,11,14,15}, {14,9,4,13,8,12},
+        };
+        for(uint32_t i=0;i<12;i++){
+            ntuple t={ i>>2, i<8 ? 4u : 6u, {} };
+            std::copy(cells[i],cells[i]+t.length,t.pos.begin());
+            tuples.push_back(t);
         }
-        for(uint32_t i=0;i<TUPLE6_SIZE;i++){
-            uint32_t feature=0;
-            for(int pos : tuple6[i]){
-                feature=(feature<<4);
-                feature+=board(pos);
-            }
-            uint32_t j=(i+TUPLE4_SIZE)>>2;
-            value+=net[j][feature];
+        plan();
+    }
 
-            if(storefeatures)
-                features6[i]=feature;
+    /**
+     * set up the isomorphic network: each base pattern is read under the first 'iso'
+     * symmetries of board::Flip_board (1, 4 rotations, or all 8), and all the
+     * isomorphic tuples of a pattern share one weight table
+     * patterns are given as cell lists separated by ';', e.g., 0,1,2,3;1,5,9,13
+     */
+    void init_isomorphic(unsigned iso, const std::string& patterns) {
+        if(iso!=1&&iso!=4&&iso!=8) throw std::invalid_argument("iso must be 1, 4, or 8");
+        sym=iso;
+        std::array<board, 8> flips;
+        for(unsigned f=0;f<sym;f++){
+            flips[f]=board(0xfedcba9876543210ull); // cell i holds i
+            flips[f].Flip_board(f);
         }
-        return value;
-    }
-    
-    void weight_update(float loss,float learning_rate){
-        if(net.size()==0)return;
-        float dW=learning_rate*loss;
-        for(uint32_t i=0;i<TUPLE4_SIZE;i++){
-            uint32_t j=i>>2;
-            net[j][features4[i]]+=dW;
-            uint32_t prediction_features=features4[i]+0b0001000100010001;
-            net[j][prediction_features]+=dW;
-        }
-        for(uint32_t i=0;i<TUPLE6_SIZE;i++){
-            uint32_t j=(i+TUPLE4_SIZE)>>2;
-            net[j][features6[i]]+=1.5*dW;
-            uint32_t prediction_features=features6[i]+0b000100010001000100010001;
-            net[j][prediction_features]+=1.5*dW;
+        std::stringstream list(patterns);
+        unsigned table=0;
+        for(std::string pattern; std::getline(list,pattern,';'); table++){
+            std::vector<int> cells;
+            std::stringstream in(pattern);
+            for(std::string cell; std::getline(in,cell,','); ) cells.push_back(std::stoi(cell));
+            if(cells.empty()||cells.size()>6) throw std::invalid_argument("bad pattern: " + pattern);
+            for(int cell : cells) if(cell<0||cell>15) throw std::invalid_argument("bad pattern: " + pattern);
+            for(unsigned f=0;f<sym;f++){
+                ntuple t={ table, uint32_t(cells.size()), {} };
+                // the tuple on the flipped board reads the cell which is flipped onto the pattern cell
+                for(unsigned k=0;k<cells.size();k++) t.pos[k]=flips[f](cells[k]);
+                tuples.push_back(t);
+            }
         }
+        plan();
     }
 
-	friend std::ostream& operator <<(std::ostream& out, const weight_agent& w) {
-		out << "Weights:" << std::endl;
-		for (int i=0;i<100;i++){
-            std::cout<<w.net[0][i*100]<<std::endl;
+    /**
+     * split the tuples into runs of one length, which are extracted by extract<length>,
+     * and build the vectorized lanes if the tuples fit them
+     */
+    void plan() {
+        runs.clear();
+        for(uint32_t i=0;i<tuples.size();i++){
+            if(runs.empty()||runs.back().length!=tuples[i].length) runs.push_back({ tuples[i].length, i, 0 });
+            runs.back().count++;
         }
-		out << std::endl;
-		return out;
-	}
-protected:
-    std::array<std::array<int, 4>, TUPLE4_SIZE> tuple4;
-	std::array<std::array<int, 6>, TUPLE6_SIZE> tuple6;
-    std::array<uint32_t, TUPLE4_SIZE> features4;
-    std::array<uint32_t, TUPLE6_SIZE> features6;
-    std::vector<weight> net;
-};
+        lanes=simd::shuffle(tuples);
+        features.resize(tuples.size());
+        index.resize(tuples.size());
+        map();
+    }
 
-/*
+    /**
+     * list the features which read each cell, and the shift of the cell in their indices,
+     * so that the indices of a board can be patched cell by cell (see update)
+     */
+    void map() {
+        scale.assign(16*tuples.size(),0);
+        for(uint32_t t=0;t<tuples.size();t++)
+            for(uint32_t k=0;k<tuples[t].length;k++)
+                scale[tuples[t].pos[k]*tuples.size()+t]|=1u<<(4*(tuples[t].length-1-k));
+    }
 
-class weight_agent : public agent {
-public:
-    weight_agent(const std::string& args = "") : agent(args),
-    tuple4({{ 
-        { {0,1,2,3} },
-        { {3,7,11,15} },
-        { {15,14,13,12} },
-        { {12,8,4,0} },
-        { {1,5,9,13} },
-        { {7,6,5,4} },
-        { {14,10,6,2} },
-        { {8,9,10,11} },
-        { {1,2,3,7} },
-        { {7,11,15,14} },
-        { {14,13,12,8} },
-        { {8,4,0,1} },
-        { {0,1,4,5} },
-        { {3,7,6,2} },
-        { {15,14,11,10} },
-        { {12,8,9,13} },
-    }})
-    {
-		if (meta.find("init") != meta.end()) // pass init=... to initialize the weight
-			init_weights(meta["init"]);
-		if (meta.find("load") != meta.end()) // pass load=... to load from a specific file
-			load_weights(meta["load"]);
-	}
-	virtual ~weight_agent() {
-		if (meta.find("save") != meta.end()) // pass save=... to save to a specific file
-			save_weights(meta["save"]);
-	}
+    /**
+     * the indices of 'count' tuples of 'length' cells, the loop over the cells is unrolled
+     */
+    template<unsigned length>
+    static void extract(board::data raw, const ntuple* t, uint32_t count, uint32_t* index) {
+        for(uint32_t i=0;i<count;i++){
+            uint32_t feature=0;
+            for(unsigned k=0;k<length;k++) feature=(feature<<4)|uint32_t((raw>>(t[i].pos[k]<<2))&0x0f);
+            index[i]=feature;
+        }
+    }
+    void extract(board::data raw, uint32_t* index) const {
+        for(const run& r : runs){
+            const ntuple* t=&tuples[r.first];
+            switch(r.length){
+            case 1: extract<1>(raw,t,r.count,index+r.first); break;
+            case 2: extract<2>(raw,t,r.count,index+r.first); break;
+            case 3: extract<3>(raw,t,r.count,index+r.first); break;
+            case 4: extract<4>(raw,t,r.count,index+r.first); break;
+            case 5: extract<5>(raw,t,r.count,index+r.first); break;
+            case 6: extract<6>(raw,t,r.count,index+r.first); break;
+            }
+        }
+    }
 
-protected:
 	virtual void init_weights(const std::string& info) {
-		net.emplace_back(65536); // create an empty weight table with size 65536
-		net.emplace_back(65536); // create an empty weight table with size 65536
-		net.emplace_back(65536); // create an empty weight table with size 65536
-		net.emplace_back(65536);
-        
-        // now net.size() == 2; net[0].size() == 65536; net[1].size() == 65536 
+        for(const ntuple& t : tuples){
+            if(t.table==net.size()) net.emplace_back(size_t(1)<<(4*t.length));
+        }
     }
+	/**
+	 * map a versioned weight file in place (pass verify=1 to check its checksum),
+	 * or read a file of the old format, which is a table count followed by the tables
+	 */
 	virtual void load_weights(const std::string& path) {
+		if (weight_file::is(path)) {
+			uint32_t iso;
+			std::vector<ntuple> file_tuples;
+			std::vector<weight> tables = weight_file::map(path, iso, file_tuples, meta.find("verify") != meta.end());
+			bool given = meta.find("tuples") != meta.end() || meta.find("iso") != meta.end();
+			if (!given && iso && file_tuples != tuples) { // adopt the tuples of the file
+				sym = iso;
+				tuples = file_tuples;
+				plan();
+			}
+			if (iso != sym || file_tuples != tuples)
+				throw std::runtime_error("the tuples in " + path + " differ from the network");
+			net.swap(tables);
+			if (!fits()) throw std::runtime_error("the tables in " + path + " do not fit the tuples");
+			return;
+		}
 		std::ifstream in(path, std::ios::in | std::ios::binary);
-		if (!in.is_open()) std::exit(-1);
+		if (!in.is_open()) throw std::runtime_error("cannot open " + path);
 		uint32_t size;
 		in.read(reinterpret_cast<char*>(&size), sizeof(size));
+		if (!in) throw std::runtime_error("truncated weight file " + path);
 		net.resize(size);
 		for (weight& w : net) in >> w;
+		if (!in) throw std::runtime_error("truncated weight file " + path);
 		in.close();
+		if (!fits()) throw std::runtime_error("the tables in " + path + " do not fit the tuples");
+	}
+
+	/**
+	 * whether there is one table per table index of the tuples, of one element type,
+	 * and each is large enough for every tuple that indexes it
+	 */
+	bool fits() const {
+		uint32_t count = 0;
+		for (const ntuple& t : tuples) count = std::max(count, t.table + 1);
+		if (net.size() != count) return false;
+		for (const weight& w : net)
+			if (w.element() != net[0].element()) return false;
+		for (const ntuple& t : tuples)
+			if (net[t.table].size() < size_t(1) << (4 * t.length)) return false;
+		return true;
 	}
 	virtual void save_weights(const std::string& path) {
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
-		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
-		out.close();
+		weight_file::save(path, net, sym, tuples);
 	}
-    
+	virtual void quantize_weights(weight::type dtype) {
+		for (weight& w : net) w = w.quantize(dtype);
+	}
+
+public:
+	/**
+	 * whether the tables are 16-bit, which can only be used for inference
+	 */
+	bool quantized() const { return net.size() && net[0].element() != weight::float32; }
+
+public:
+    /**
+     * the number of symmetries (a prefix of board::Flip_board: all 8, the 4 rotations, or only the identity)
+     * that leave V_function unchanged, which they do if they map the tuples of every table onto themselves
+     */
+    unsigned isomorphism() const {
+        for(unsigned n : { 8u, 4u }){
+            bool closed=true;
+            for(unsigned f=1;closed&&f<n;f++)closed=invariant(f);
+            if(closed)return n;
+        }
+        return 1;
+    }
+
+protected:
+    /**
+     * whether the f-th symmetry maps the tuples onto themselves: a tuple read on the flipped board
+     * reads the cells of another tuple of its table, in the same order
+     */
+    bool invariant(unsigned f) const {
+        board flip(0xfedcba9876543210ull); // cell i holds i
+        flip.Flip_board(f);
+        auto less=[](const ntuple& a,const ntuple& b){
+            if(a.table!=b.table)return a.table<b.table;
+            if(a.length!=b.length)return a.length<b.length;
+            return std::lexicographical_compare(a.pos.begin(),a.pos.begin()+a.length,b.pos.begin(),b.pos.begin()+b.length);
+        };
+        std::vector<ntuple> from(tuples),onto(tuples);
+        for(ntuple& t : onto)
+            for(uint32_t k=0;k<t.length;k++)t.pos[k]=flip(t.pos[k]);
+        std::sort(from.begin(),from.end(),less);
+        std::sort(onto.begin(),onto.end(),less);
+        return from==onto;
+    }
+
 public:
+
+    /**
+     * the sum of the weights of all tuples, the indices are kept for weight_update if storefeatures is set
+     * the vectorized kernel is chosen at runtime, pass simd=scalar|avx2 to override it
+     */
     float V_function(const board& board,bool storefeatures){
+        return V_function(board,storefeatures?features.data():nullptr);
+    }
 
+    /**
+     * the same sum, with the indices (width() of them) written to 'into' if it is given,
+     * so that the indices of several afterstates can be kept and one of them adopted later
+     */
+    float V_function(const board& board,uint32_t* into){
+        if(net.size()==0)return noise(board.raw());
+        if(!lanes.fits())return V_scalar(board,into);
+        switch(isa*4+net[0].element()){
+        case simd::avx2*4+weight::float32: return simd::evaluate_avx2<weight::float32>(board.raw(),lanes,net,tuples,into);
+        case simd::avx2*4+weight::float16: return simd::evaluate_avx2<weight::float16>(board.raw(),lanes,net,tuples,into);
+        case simd::avx2*4+weight::int16: return simd::evaluate_avx2<weight::int16>(board.raw(),lanes,net,tuples,into);
+        default: return V_scalar(board,into);
+        }
+    }
+
+    /**
+     * the indices (width() of them) of a board, without reading the tables
+     */
+    void indices(const board& board,uint32_t* into) const {
+        if(isa==simd::scalar||!lanes.fits())return extract(board.raw(),into);
+        simd::indices_avx2(board.raw(),lanes,into);
+    }
+
+    /**
+     * patch the indices of a board into the ones of another board, where 'changed' is the xor of the
+     * two packed boards: a place changes one cell and a slide only the lines which moved, so only
+     * the few features which read a changed cell are touched
+     */
+    void update(board::data changed,uint32_t* index) const {
+        const size_t w=width();
+        if(isa!=simd::scalar)return simd::update_avx2(changed,scale.data(),w,index);
+        while(changed){
+            unsigned p=__builtin_ctzll(changed)>>2;
+            uint32_t d=uint32_t(changed>>(p<<2))&0x0f;
+            changed&=~(board::data(0x0f)<<(p<<2));
+            const uint32_t* m=&scale[p*w];
+            for(size_t t=0;t<w;t++)index[t]^=d*m[t];
+        }
+    }
+
+    /**
+     * the value of an afterstate from its indices, e.g., from the ones of the board before the slide
+     * patched by update
+     */
+    float V_function(const uint32_t* index){
+        const size_t w=width();
+        if(net.size()==0){
+            uint64_t h=0;
+            for(size_t t=0;t<w;t++)h=rng::mix(h^index[t]);
+            return noise(h);
+        }
+        if(vectorized())return sum(index);
+        for(size_t t=0;t<w;t++)net[table(t)].prefetch(index[t]);
         float value=0;
-        if(net.size()==0)return float(rand());
-        for(uint32_t i=0;i<tuple4.size();i++){
-            uint32_t feature=0;
-            for(int pos : tuple4[i]){
-                feature=(feature<<4);
-                feature+=board(pos);
+        for(size_t t=0;t<w;t++)value+=net[table(t)].get(index[t]);
+        return value;
+    }
+
+    /**
+     * the values of n afterstates given as packed boards (board::raw()) rather than board objects;
+     * the indices of a chunk of boards are all extracted and their entries prefetched one chunk
+     * ahead of the reads, so the table misses of many boards are in flight at once
+     */
+    void V_batch(const board::data* boards,size_t n,float* values){
+        if(net.size()==0){
+            for(size_t i=0;i<n;i++)values[i]=noise(boards[i]);
+            return;
+        }
+        if(n<4){ // too few to overlap
+            for(size_t i=0;i<n;i++)values[i]=V_function(board(boards[i]),false);
+            return;
+        }
+        const size_t w=width(),chunk=16;
+        batch.resize(2*chunk*w);
+        for(size_t first=0,stage=0;first<n;first+=chunk,stage^=1){
+            for(size_t next=first?first+chunk:0;next<std::min(first+2*chunk,n);next++){
+                uint32_t* at=&batch[(((next/chunk)&1)*chunk+next%chunk)*w];
+                indices(board(boards[next]),at);
+                for(size_t t=0;t<w;t++)net[table(t)].prefetch(at[t]);
+            }
+            for(size_t i=first;i<std::min(first+chunk,n);i++){
+                const uint32_t* at=&batch[(stage*chunk+i-first)*w];
+                values[i]=sum(at);
             }
-            uint32_t j=i>>2; 
-            value+=net[j][feature];
+        }
+    }
+
+    /**
+     * the value of a board (or of its indices) without a network, a hash rather than rand(),
+     * so that it does not depend on the thread or on what was evaluated before
+     */
+    static float noise(uint64_t key){ return float(rng::mix(key)>>33); }
+
+    /**
+     * whether the indices are extracted and the entries gathered by the vectorized kernels
+     */
+    bool vectorized() const { return isa!=simd::scalar&&lanes.fits(); }
 
-            if(storefeatures)
-                features[i]=feature;
+    /**
+     * the sum of the entries of the indices of a board
+     */
+    float sum(const uint32_t* index) const {
+        if(vectorized()){
+            switch(net[0].element()){
+            case weight::float32: return simd::sum_avx2<weight::float32>(lanes,net,tuples,index);
+            case weight::float16: return simd::sum_avx2<weight::float16>(lanes,net,tuples,index);
+            case weight::int16: return simd::sum_avx2<weight::int16>(lanes,net,tuples,index);
+            }
         }
+        float value=0;
+        for(size_t t=0;t<tuples.size();t++)value+=net[tuples[t].table].get(index[t]);
+        return value;
+    }
 
+    /**
+     * extract all indices and prefetch their entries before summing, so the misses overlap
+     */
+    float V_scalar(const board& board,uint32_t* into){
+        extract(board.raw(),index.data());
+        for(uint32_t i=0;i<tuples.size();i++)
+            net[tuples[i].table].prefetch(index[i]);
+        float value=0;
+        for(uint32_t i=0;i<tuples.size();i++)
+            value+=net[tuples[i].table].get(index[i]);
+        if(into)
+            std::copy(index.begin(),index.end(),into);
         return value;
     }
-    
+
     void weight_update(float loss,float learning_rate){
-        if(net.size()==0)return;
+        if(net.size()==0||learning_rate==0)return; // no write, so mapped pages stay shared
         float dW=learning_rate*loss;
-        for(uint32_t i=0;i<tuple4.size();i++){
-            uint32_t j=i>>2;
-            net[j][features[i]]+=dW;
+        if(sym){
+            for(uint32_t i=0;i<tuples.size();i++)
+                net[tuples[i].table].learn(features[i],dW);
+            return;
+        }
+        for(uint32_t i=0;i<tuples.size();i++)
+            learn_fixed(i,features[i],dW);
+    }
+
+    /**
+     * the fixed network also learns the entry with every cell one tile larger, and a 6-tuple learns 1.5 times as fast
+     */
+    void learn_fixed(uint32_t i,uint32_t feature,float dW){
+        weight& w=net[tuples[i].table];
+        if(tuples[i].length==4){
+            w.learn(feature,dW);
+            uint32_t prediction_features=feature+0b0001000100010001;
+            w.learn(prediction_features,dW);
+        }else{
+            w.learn(feature,1.5*dW);
+            uint32_t prediction_features=feature+0b000100010001000100010001;
+            w.learn(prediction_features,1.5*dW);
+        }
+    }
+
+    /**
+     * the number of features stored by V_function, which is the length of an entry of a trace
+     */
+    size_t width() const { return tuples.size(); }
+
+    /**
+     * the table of the t-th feature
+     */
+    uint32_t table(size_t t) const { return tuples[t].table; }
+
+    /**
+     * append the features stored by the last V_function(...,true) to a trace
+     */
+    void record(std::vector<uint32_t>& trace) const {
+        trace.insert(trace.end(),features.begin(),features.end());
+    }
+
+    /**
+     * keep the indices written by V_function(board,into) for weight_update, as if the board
+     * had been evaluated with storefeatures set
+     */
+    void adopt(const uint32_t* into){
+        std::copy(into,into+features.size(),features.begin());
+    }
+
+    /**
+     * add learning_rate*loss[t] to the features of the t-th entry of a trace, as weight_update does,
+     * table by table: the tuples of a table are contiguous, so every entry touches one table before
+     * the next table is visited, and the writes of a table stay in its cache and TLB entries
+     */
+    void weight_update(const std::vector<uint32_t>& trace,const std::vector<float>& loss,float learning_rate){
+        if(net.size()==0||learning_rate==0)return;
+        const size_t n=width();
+        for(size_t first=0,last;first<n;first=last){
+            uint32_t j=table(first);
+            for(last=first+1;last<n&&table(last)==j;last++);
+            weight& w=net[j];
+            for(size_t t=0;t<loss.size();t++){
+                float dW=learning_rate*loss[t];
+                const uint32_t* f=&trace[t*n];
+                for(size_t i=first;i<last;i++){
+                    if(sym)w.learn(f[i],dW);
+                    else learn_fixed(i,f[i],dW);
+                }
+            }
         }
     }
 
@@ -301,12 +590,22 @@ public:
 		return out;
 	}
 protected:
-    std::array<std::array<int, 4>, 16> tuple4;
-	std::vector<weight> net;
-    std::array<uint32_t, 16> features;
+    simd::isa isa;
+
+    unsigned sym; // number of isomorphisms, or 0 for the fixed network of init_fixed
+    std::vector<ntuple> tuples;
+    struct run { uint32_t length, first, count; };
+    std::vector<run> runs; // consecutive tuples of one length
+    simd::shuffle lanes; // the vectorized extraction of the tuples, if they fit it
+    std::vector<uint32_t> scale; // 16 rows of width(): the bit of each cell in the index of each feature, 0 if it is not read
+    std::vector<uint32_t> features; // the indices kept for weight_update, width() of them
+    std::vector<uint32_t> index; // scratch indices of V_function
+    std::vector<uint32_t> batch; // scratch indices of V_batch, two chunks
+    std::shared_ptr<std::vector<weight>> shared;
+    std::vector<weight>& net;
+    std::shared_ptr<checkpoint> saver;
 };
 
-*/
 
 
 /**
@@ -314,20 +613,150 @@ protected:
  */
 class learning_agent : public agent {
 public:
-	learning_agent(const std::string& args = "") : agent(args), alpha(0.1f) {
+	learning_agent(const std::string& args = "") : agent(args), alpha(0.1f), lambda(-1) {
 		if (meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if (meta.find("lambda") != meta.end()) { // pass lambda=... to learn from lambda-returns at the end of each episode
+			lambda = float(meta["lambda"]);
+			if (lambda < 0 || lambda > 1) throw std::invalid_argument("lambda must be in [0, 1]");
+		}
 	}
 	virtual ~learning_agent() {}
     
     inline float get_alpha(){return alpha;}
+    inline float get_lambda(){return lambda;}
+
+    /**
+     * whether the updates are batched at the end of each episode (TD(lambda)) rather than made
+     * in place on every move (TD(0))
+     */
+    bool batched() const { return lambda >= 0 && alpha != 0; }
 
 protected:
 	float alpha;
+	float lambda;
 };
 
 
 
+/**
+ * expectimax search over afterstates
+ *
+ * max nodes try the four slides, chance nodes follow the rules of rndenv:
+ * the next tile is placed on an empty cell of spawn_space()[last opcode],
+ * and is assumed to be 1, 2 or 3 with equal probability (the bag is hidden)
+ * the value of an afterstate at the search horizon is given by V_function
+ * if incremental(depth) is set, the indices of every node are patched from the ones of its parent
+ */
+class expectimax {
+public:
+	/**
+	 * counters shared by all the copies of a player
+	 */
+	struct statistic {
+		std::atomic<uint64_t> nodes;
+		std::atomic<uint64_t> moves;
+		std::atomic<uint64_t> nanos;
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		statistic() : nodes(0), moves(0), nanos(0), hits(0), misses(0) {}
+	};
+
+public:
+	expectimax(weight_agent& value, transposition* table = nullptr) : value(value), table(table), nodes(0), hits(0), misses(0) {}
+
+	/**
+	 * keep the indices of the nodes of a search of up to 'depth' slides, two nodes per slide
+	 */
+	void incremental(unsigned depth) { stack.assign(2 * depth * value.width(), 0); }
+
+	/**
+	 * the expected value of an afterstate produced by opcode op, with depth more slides to search
+	 * afterstate values are cached in the transposition table if there is one, except
+	 * at the horizon where a lookup costs about as much as V_function itself
+	 * the indices of the afterstate are given if they are known (width() of them)
+	 */
+	float chance(const board& after, unsigned op, unsigned depth, const uint32_t* index = nullptr) {
+		nodes++;
+		float v;
+		if (table && depth) {
+			if (table->probe(after, op, depth, v)) {
+				hits++;
+				return v;
+			}
+			misses++;
+		}
+		v = expect(after, op, depth, index);
+		if (table && depth) table->store(after, op, depth, v);
+		return v;
+	}
+
+	/**
+	 * the best value of a state, which is zero if the game is over
+	 */
+	float max(const board& before, unsigned depth, const uint32_t* index = nullptr) {
+		nodes++;
+		float best = 0;
+		bool legal = false;
+		uint32_t* child = index && stack.size() ? &stack[2 * depth * value.width()] : nullptr;
+		for (unsigned op = 0; op < 4; op++) {
+			board b(before);
+			board::reward R = b.slide(op);
+			if (R == -1) continue;
+			if (child) patch(index, b.raw() ^ before.raw(), child);
+			float VR = R + chance(b, op, depth - 1, child);
+			if (!legal || VR > best) best = VR;
+			legal = true;
+		}
+		return best;
+	}
+
+	/**
+	 * move the counters since the last call to the shared statistic
+	 */
+	void flush(statistic& stat) {
+		stat.nodes += nodes;
+		stat.hits += hits;
+		stat.misses += misses;
+		nodes = hits = misses = 0;
+	}
+
+private:
+	float expect(const board& after, unsigned op, unsigned depth, const uint32_t* index) {
+		if (depth == 0) return index ? value.V_function(index) : value.V_function(after, false);
+		float sum = 0;
+		unsigned count = 0;
+		uint32_t* child = index && stack.size() ? &stack[(2 * depth + 1) * value.width()] : nullptr;
+		for (int pos : spawn_space()[op]) {
+			if (after(pos) != 0) continue;
+			for (board::cell tile = 1; tile <= 3; tile++) {
+				board b(after);
+				b.place(pos, tile);
+				if (child) patch(index, b.raw() ^ after.raw(), child);
+				sum += max(b, depth, child);
+				count++;
+			}
+		}
+		return count ? sum / count : index ? value.V_function(index) : value.V_function(after, false);
+	}
+
+	/**
+	 * the indices of a child node, from the ones of its parent and the cells which differ
+	 */
+	void patch(const uint32_t* index, board::data changed, uint32_t* child) {
+		std::copy(index, index + value.width(), child);
+		value.update(changed, child);
+	}
+
+private:
+	weight_agent& value;
+	transposition* table;
+	uint64_t nodes;
+	uint64_t hits;
+	uint64_t misses;
+	std::vector<uint32_t> stack; // the indices of the nodes being searched, see incremental()
+};
+
 /**
  * dummy player
  * select a legal action randomly
@@ -340,57 +769,230 @@ public:
         WTF_learning_agent(args),
         last_opcode(666),
         opcode({ 0, 1, 2, 3 }),
-        movecnt(0),last_V(0){}
+        movecnt(0),last_V(0),
+        depth(1),incremental(false),
+        current(WTF_weight_agent.width(),0),
+        table(meta.find("tt") != meta.end() ? new transposition(int(meta["tt"]), WTF_weight_agent.isomorphism()) : nullptr),
+        search(WTF_weight_agent,table.get()),searched(std::make_shared<expectimax::statistic>()){
+        if (WTF_weight_agent.quantized() && WTF_learning_agent.get_alpha() != 0)
+            throw std::invalid_argument("quantized weights are for inference only, use alpha=0");
+        if (meta.find("search") != meta.end()) { // pass search=expectimax depth=... to search deeper than one slide
+            if (property("search") != "expectimax") throw std::invalid_argument("unknown search: " + property("search"));
+            depth = meta.find("depth") != meta.end() ? std::max(int(meta["depth"]), 1) : 2;
+        }
+        if (table && depth < 4) // the shallower searches measured slower with the table than without it (see README)
+            throw std::invalid_argument("tt needs search=expectimax depth=4 or more");
+        // pass incremental=0|1 to choose whether the indices of each board are patched from the last one, by default
+        // they are unless the tuples are vectorized, whose extraction is faster than patching (see README)
+        incremental = meta.find("incremental") != meta.end() ? int(meta["incremental"]) != 0 : !WTF_weight_agent.vectorized();
+        if (incremental && depth > 1) search.incremental(depth);
+    }
+    player(const player& p) : random_agent(p),
+        WTF_weight_agent(p.WTF_weight_agent),
+        WTF_learning_agent(p.WTF_learning_agent),
+        last_opcode(666),
+        opcode(p.opcode),
+        movecnt(0),last_V(0),
+        depth(p.depth),incremental(p.incremental),current(p.current.size(),0),table(p.table),search(WTF_weight_agent,table.get()),searched(p.searched){
+        if (incremental && depth > 1) search.incremental(depth);
+    }
 
 	virtual action take_action(const board& before) {
         //std::cout<<"player act"<<std::endl;
 		//std::shuffle(opcode.begin(), opcode.end(), engine);
 		
-        board best_board(before);
+        auto start = std::chrono::steady_clock::now();
+        // one pass over the slides: every legal afterstate is evaluated once with its indices kept,
+        // and the indices of the chosen one are adopted for the update instead of evaluating it again
+        const size_t width=WTF_weight_agent.width();
+        candidates.resize(4*width);
+        if(incremental){ // the indices of the last afterstate, patched through the tile placed since
+            profile::scope timer(profile::evaluate);
+            WTF_weight_agent.update(before.raw()^known.raw(),current.data());
+            known=before;
+        }
         unsigned best_op=6;
         float best_VR=0;
+        float best_SV=0;
+        float best_V=0;
         for (unsigned op : opcode) {
             board b(before);
-			board::reward R = b.slide(op);
+			board::reward R;
+            {
+                profile::scope timer(profile::slide);
+                R = b.slide(op);
+            }
             if(R!=-1){
-                float V = WTF_weight_agent.V_function(b,false);
+                float V;
+                {
+                    profile::scope timer(profile::evaluate);
+                    uint32_t* into=&candidates[op*width];
+                    if(incremental){ // only the lines which moved are patched
+                        std::copy(current.begin(),current.end(),into);
+                        WTF_weight_agent.update(b.raw()^before.raw(),into);
+                        V = WTF_weight_agent.V_function(into);
+                    }else{
+                        V = WTF_weight_agent.V_function(b,into);
+                    }
+                }
                 float VR=V+(float)R;
+                // the search value only selects the move, the TD target is still VR
+                float SV = depth > 1 ? search.chance(b,op,depth-1,&candidates[op*width])+(float)R : VR;
                 if(best_op==6){
                     best_op=op;
                     best_VR=VR;
-                    best_board=b;
+                    best_SV=SV;
+                    best_V=V;
                 }
-                else if(best_VR<VR){
+                else if(best_SV<SV){
                     best_op=op;
                     best_VR=VR;
-                    best_board=b;
+                    best_SV=SV;
+                    best_V=V;
                 }
             }
         }
+        if(depth > 1){
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            search.flush(*searched);
+            searched->moves += 1;
+            searched->nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        }
+        if(incremental&&best_op!=6){
+            known=before;
+            known.slide(best_op);
+            std::copy(&candidates[best_op*width],&candidates[(best_op+1)*width],current.begin());
+        }
         
+        if(WTF_learning_agent.batched()){ // the trace is learned at close_episode
+            if(best_op==6)return action();
+            if(movecnt>0)rewards.push_back(best_VR-best_V);
+            movecnt+=1;
+            last_opcode=best_op;
+            values.push_back(best_V);
+            trace.insert(trace.end(),&candidates[best_op*width],&candidates[(best_op+1)*width]);
+            return action::slide(best_op);
+        }
         if(best_op==6){
             //std::cout<<"Game over"<<std::endl;
+            profile::scope timer(profile::update);
             WTF_weight_agent.weight_update(-last_V,WTF_learning_agent.get_alpha());
+            updated();
             return action();
             //illegel -> game over
         }
-        if(movecnt>0)
+        if(movecnt>0){
+            profile::scope timer(profile::update);
             WTF_weight_agent.weight_update(best_VR-last_V,WTF_learning_agent.get_alpha());
+            updated();
+        }
         
         movecnt+=1;
         last_opcode=best_op;
-        last_V=WTF_weight_agent.V_function(best_board,true);
+        // the value and indices were read before the update above, which may touch the same entries
+        last_V=best_V;
+        WTF_weight_agent.adopt(&candidates[best_op*width]);
         return action::slide(best_op);
 	}
-    virtual void open_episode(const std::string& flag = "") {last_opcode=666;movecnt=0;last_V=0;}
+    /**
+     * the value of each slide of a board as take_action sees it (the reward plus the value of the
+     * afterstate, or the search value if searching), -inf if the slide is illegal, and the slide
+     * take_action would choose (4 if none is legal); nothing is learned
+     */
+    unsigned evaluate(const board& before, std::array<float,4>& values){
+        unsigned best_op=4;
+        values.fill(-std::numeric_limits<float>::infinity());
+        for (unsigned op : opcode) {
+            board b(before);
+            board::reward R=b.slide(op);
+            if(R==-1)continue;
+            float VR=WTF_weight_agent.V_function(b,false)+(float)R;
+            values[op] = depth > 1 ? search.chance(b,op,depth-1)+(float)R : VR;
+            if(best_op==4||values[best_op]<values[op])best_op=op;
+        }
+        return best_op;
+    }
+
+    virtual void open_episode(const std::string& flag = "") {
+        last_opcode=666;movecnt=0;last_V=0;
+        trace.clear();values.clear();rewards.clear();
+    }
+
+    /**
+     * learn the afterstates of the episode from their lambda-returns in one backward pass,
+     * the return of the last afterstate is 0, and the one of an earlier afterstate t is
+     * G(t) = r(t+1) + (1-lambda)*V(t+1) + lambda*G(t+1), where V is the value when it was played
+     * (so lambda=0 is the TD(0) target of the in-place updates)
+     */
+    virtual void close_episode(const std::string& flag = "") {
+        if(WTF_learning_agent.batched()&&values.size()){
+            profile::scope timer(profile::update);
+            float lambda=WTF_learning_agent.get_lambda(),G=0;
+            loss.resize(values.size());
+            for(size_t t=values.size();t-->0;){
+                if(t+1<values.size())G=rewards[t]+(1-lambda)*values[t+1]+lambda*G;
+                loss[t]=G-values[t];
+            }
+            WTF_weight_agent.weight_update(trace,loss,WTF_learning_agent.get_alpha());
+            updated();
+        }
+        WTF_weight_agent.close_episode(flag,movecnt);
+    }
+
+    bool searching() const { return depth > 1; }
+
+    /**
+     * print the search statistic since the last report, e.g.,
+     * 	search: depth = 3, nodes = 10234/move, nps = 5123456, tt = 41.2% (1638400)
+     * where the transposition table hit rate and size are shown only if it is used
+     */
+    void report(std::ostream& out) {
+        uint64_t nodes = searched->nodes.exchange(0);
+        uint64_t moves = searched->moves.exchange(0);
+        uint64_t nanos = searched->nanos.exchange(0);
+        uint64_t hits = searched->hits.exchange(0);
+        uint64_t misses = searched->misses.exchange(0);
+        std::ios ff(nullptr);
+        ff.copyfmt(out);
+        out << std::fixed << std::setprecision(0);
+        out << "\t" << "search: depth = " << depth << ", ";
+        out << "nodes = " << (moves ? nodes / double(moves) : 0) << "/move, ";
+        out << "nps = " << (nanos ? nodes * 1e9 / nanos : 0);
+        if (table) {
+            out << std::setprecision(1);
+            out << ", tt = " << (hits + misses ? hits * 100.0 / (hits + misses) : 0) << "%";
+            out << " (" << table->size() << ")";
+        }
+        out << std::endl;
+        out.copyfmt(ff);
+    }
 public:
     weight_agent WTF_weight_agent;
     learning_agent WTF_learning_agent;
     unsigned last_opcode;
 private:
+    /**
+     * the weights have changed, so the values searched before are stale
+     */
+    void updated(){
+        if(table&&WTF_learning_agent.get_alpha()!=0)table->next_generation();
+    }
+
 	std::array<unsigned, 4> opcode;
     float movecnt;
     float last_V;
+    unsigned depth;
+    bool incremental;
+    board known; // the last board seen if incremental, whose indices are 'current'
+    std::vector<uint32_t> current;
+    std::shared_ptr<transposition> table;
+    expectimax search;
+    std::shared_ptr<expectimax::statistic> searched;
+    std::vector<uint32_t> candidates; // the features of the afterstate of each slide, width() per slide
+    std::vector<uint32_t> trace; // the features of the afterstates of the episode, width() per afterstate
+    std::vector<float> values; // the value of each afterstate when it was played
+    std::vector<float> rewards; // the reward of the move after each afterstate
+    std::vector<float> loss;
 };
 
 
@@ -405,66 +1007,38 @@ private:
 class rndenv : public random_agent {
 public:
     rndenv(const std::string& args = "",player* pp=0) : random_agent("name=random role=environment " + args),
-        space({{ 
-            { {12,13,14,15} },
-            { {0,4,8,12} },
-            { {0,1,2,3} },
-            { {3,7,11,15} }
-        }}),bag({1,2,3}),used_tiles(0),pplayer(pp),
-        WTF_space_only_for_initial({0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15})
-        {
-            std::shuffle(WTF_space_only_for_initial.begin(), WTF_space_only_for_initial.end(), engine);
-        }
+        bag({1,2,3}),used_tiles(0),pplayer(pp){}
         
 	virtual action take_action(const board& after) {
         //std::cout<<"env act"<<std::endl;
-        board::cell tile;
-        //board::cell next_tile;
-        tile=bag[used_tiles];
-        used_tiles++;
-        if(used_tiles==3){
-            std::shuffle(bag.begin(), bag.end(), engine);
-            used_tiles=0;
-        }
-        //next_tile=bag[used_tiles];
-        //std::cout<<"last_opcode:"<<pplayer->last_opcode<<std::endl;
-        /*
-        switch (pplayer->last_opcode) {
-            case 0: space={12,13,14,15};//slide_up() 
-            case 1: space={0,4,8,12};//slide_right() 
-            case 2: space={0,1,2,3};//slide_down() 
-            case 3: space={3,7,11,15};//slide_left()
-		}*/
+        profile::scope timer(profile::environment);
+        // the bag is shuffled lazily: each tile is a bounded draw among the ones left of the set of three
+        if(used_tiles==3)used_tiles=0;
+        std::swap(bag[used_tiles],bag[used_tiles+engine.below(3-used_tiles)]);
+        board::cell tile=bag[used_tiles++];
+        // the cell is a bounded draw among the empty cells of the edge opposite to the last slide,
+        // or of the whole board before the first slide
+        std::array<int,16> empty;
+        unsigned n=0;
         unsigned lop=pplayer->last_opcode;
         if(lop==666){
-            for (int pos : WTF_space_only_for_initial) {
-                if (after(pos) != 0) continue;
-                return action::place(pos, tile);
-            }
+            for(int pos=0;pos<16;pos++)if(after(pos)==0)empty[n++]=pos;
+        }else{
+            for(int pos : spawn_space()[lop])if(after(pos)==0)empty[n++]=pos;
         }
-		std::shuffle(space[lop].begin(), space[lop].end(), engine);
-		for (int pos : space[lop]) {
-			if (after(pos) != 0) continue;
-            //check if action legel
-            //pos = location
-            //tile = the number
-			return action::place(pos, tile);
-		}
-        
-		return action();
+        if(n==0)return action();
         //illegel -> game over
+        return action::place(empty[engine.below(n)],tile);
 	}
     virtual void open_episode(const std::string& flag = "") {
+        // start every episode from the same state, so that an episode only depends on the random stream
+        bag={{1,2,3}};
         used_tiles=0;
-        std::shuffle(WTF_space_only_for_initial.begin(), WTF_space_only_for_initial.end(), engine);
         }
 private:
 
-    std::array<std::array<int, 4>, 4> space;
     std::array<board::cell, 3> bag;
     int used_tiles;
     player* pplayer;
-    std::array<int,16> WTF_space_only_for_initial;
-	//std::uniform_int_distribution<int> popup;
 };
 
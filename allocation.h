@@ -0,0 +1,22 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+/**
+ * heap allocation counter
+ *
+ * the counter is bumped by the replacement operator new defined in threes.cpp,
+ * so the episode loop can be checked to run without any allocation after warm-up
+ */
+namespace allocation {
+
+inline std::atomic<uint64_t>& counter() {
+	static std::atomic<uint64_t> count(0);
+	return count;
+}
+
+inline uint64_t count() {
+	return counter().load(std::memory_order_relaxed);
+}
+
+} // namespace allocation
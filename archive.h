@@ -0,0 +1,313 @@
+#pragma once
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "board.h"
+#include "action.h"
+#include "episode.h"
+
+/**
+ * binary episode log
+ *
+ * a file is laid out as
+ *  magic "THREESL\x01"
+ *  records, each one is a varint byte length followed by
+ *   open tag, open time (varint), close tag, close time - open time (varint),
+ *   number of moves (varint), then the moves
+ *  index, the 64-bit file offset of every record
+ *  tags, the number of tags (varint) and every tag (varint length, bytes)
+ *  trailer, the 64-bit number of records, the 64-bit offsets of the index and the tags, and magic "THREESI\x01"
+ *
+ * a tag is interned as varint (id << 1 | new), where a new tag is followed by its string,
+ * so a log can be streamed from the start without the tag table of the trailer
+ *
+ * a move is a byte of (time? << 7 | reward? << 6 | code), followed by the reward and the time
+ * (varints) if they are not zero; the code is
+ *  0-47: place at position (code & 15) of tile (code >> 4) + 1
+ *  48-51: slide of opcode code - 48
+ *  63: any other action, followed by its 16-bit code (0x8000 | opcode, tile << 4 | position, or 0xffff)
+ * all times are in microseconds
+ * the final board is rebuilt by replaying the moves, as the text format does
+ */
+class archive {
+public:
+	static const char* signature() { return "THREESL\x01"; }
+	static const char* trailer() { return "THREESI\x01"; }
+
+	/**
+	 * whether a file starts with the binary signature
+	 */
+	static bool is(const std::string& path) {
+		char magic[8] = {};
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		return in.read(magic, sizeof(magic)) && std::memcmp(magic, signature(), sizeof(magic)) == 0;
+	}
+
+	/**
+	 * append episodes to a new binary log, the index is written by close()
+	 */
+	class writer {
+	public:
+		writer(const std::string& path) : buffer(1 << 20), path(path), offset(8) {
+			out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+			out.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out.write(signature(), 8)) throw std::runtime_error("cannot write " + path);
+		}
+		~writer() { if (out.is_open()) out.close(); }
+
+		void write(const episode& ep) {
+			body.clear();
+			put_tag(body, ep.ep_open.tag);
+			put_varint(body, ep.ep_open.when);
+			put_tag(body, ep.ep_close.tag);
+			put_varint(body, ep.ep_close.when - ep.ep_open.when);
+			put_varint(body, ep.ep_moves.size());
+			for (const episode::move& mv : ep.ep_moves) put_move(body, mv);
+			head.clear();
+			put_varint(head, body.size());
+			index.push_back(offset);
+			out.write(head.data(), head.size());
+			out.write(body.data(), body.size());
+			offset += head.size() + body.size();
+		}
+
+		void close() {
+			uint64_t count = index.size(), start = offset, dict = offset + sizeof(uint64_t) * count;
+			out.write(reinterpret_cast<const char*>(index.data()), sizeof(uint64_t) * count);
+			body.clear();
+			put_varint(body, names.size());
+			for (const std::string& name : names) put_string(body, name);
+			out.write(body.data(), body.size());
+			out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			out.write(reinterpret_cast<const char*>(&start), sizeof(start));
+			out.write(reinterpret_cast<const char*>(&dict), sizeof(dict));
+			out.write(trailer(), 8);
+			out.close();
+			if (!out) throw std::runtime_error("cannot write " + path);
+		}
+
+	private:
+		void put_tag(std::string& out, const std::string& tag) {
+			auto it = tags.find(tag);
+			if (it != tags.end()) return put_varint(out, it->second << 1);
+			uint64_t id = names.size();
+			tags[tag] = id;
+			names.push_back(tag);
+			put_varint(out, (id << 1) | 1);
+			put_string(out, tag);
+		}
+
+		std::vector<char> buffer;
+		std::ofstream out;
+		std::string path;
+		uint64_t offset;
+		std::vector<uint64_t> index;
+		std::unordered_map<std::string, uint64_t> tags;
+		std::vector<std::string> names;
+		std::string head, body;
+	};
+
+	/**
+	 * read the episodes of a binary log one by one, only the current record is held in memory
+	 */
+	class reader {
+	public:
+		reader(const std::string& path) : buffer(1 << 20), path(path), count(0), start(0), offset(8) {
+			in.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+			in.open(path, std::ios::in | std::ios::binary);
+			char magic[8] = {};
+			if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, signature(), sizeof(magic)) != 0)
+				throw std::runtime_error("unsupported episode log " + path);
+			uint64_t dict = 0;
+			char tail[8] = {};
+			in.seekg(0, std::ios::end);
+			uint64_t length = in.tellg();
+			if (length >= 40 && in.seekg(-32, std::ios::end) && in.read(reinterpret_cast<char*>(&count), sizeof(count))
+					&& in.read(reinterpret_cast<char*>(&start), sizeof(start)) && in.read(reinterpret_cast<char*>(&dict), sizeof(dict))
+					&& in.read(tail, sizeof(tail)) && std::memcmp(tail, trailer(), sizeof(tail)) == 0
+					&& start <= dict && dict <= length - 32) {
+				body.resize(length - 32 - dict);
+				in.seekg(dict);
+				in.read(&body[0], body.size());
+				const char* p = body.data();
+				const char* end = p + body.size();
+				uint64_t size;
+				if (!get_varint(p, end, size)) throw std::runtime_error("corrupted episode log " + path);
+				names.resize(size);
+				for (std::string& name : names)
+					if (!get_string(p, end, name)) throw std::runtime_error("corrupted episode log " + path);
+			} else {
+				count = 0, start = 0; // no index (e.g., an interrupted write), records are read up to the end
+			}
+			in.clear();
+			in.seekg(8);
+		}
+
+		/**
+		 * the number of records, or 0 if the log has no index
+		 */
+		size_t size() const { return count; }
+
+		/**
+		 * decode the next record, false at the end of the records
+		 */
+		bool next(episode& ep) {
+			std::streambuf& buf = *in.rdbuf();
+			if (start && offset >= start) return false;
+			uint64_t size = 0;
+			for (unsigned shift = 0; ; shift += 7) {
+				int c = buf.sbumpc();
+				if (c == std::char_traits<char>::eof()) return false;
+				offset++;
+				size |= uint64_t(c & 0x7f) << shift;
+				if (!(c & 0x80)) break;
+			}
+			body.resize(size);
+			if (uint64_t(buf.sgetn(&body[0], size)) != size) return false;
+			offset += size;
+			if (!decode(ep, body.data(), body.data() + size)) throw std::runtime_error("corrupted episode log " + path);
+			return true;
+		}
+
+		/**
+		 * move to the i-th record through the index
+		 */
+		bool seek(size_t i) {
+			if (i >= count) return false;
+			in.clear();
+			in.seekg(start + sizeof(uint64_t) * i);
+			in.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+			in.seekg(offset);
+			return bool(in);
+		}
+
+	private:
+		/**
+		 * decode a record and replay its moves, false if the record is malformed
+		 */
+		bool decode(episode& ep, const char* p, const char* end) {
+			uint64_t when, span, size;
+			ep.ep_state = episode::initial_state();
+			ep.ep_score = 0;
+			ep.ep_time = 0;
+			if (!get_tag(p, end, ep.ep_open.tag) || !get_varint(p, end, when)) return false;
+			ep.ep_open.when = when;
+			if (!get_tag(p, end, ep.ep_close.tag) || !get_varint(p, end, span)) return false;
+			ep.ep_close.when = when + span;
+			if (!get_varint(p, end, size) || size > uint64_t(end - p)) return false;
+			ep.ep_moves.resize(size);
+			for (episode::move& mv : ep.ep_moves) {
+				if (!get_move(p, end, mv)) return false;
+				replay(mv.code, ep.ep_state);
+				ep.ep_score += mv.reward;
+			}
+			return true;
+		}
+
+		bool get_tag(const char*& p, const char* end, std::string& tag) {
+			uint64_t ref;
+			if (!get_varint(p, end, ref)) return false;
+			uint64_t id = ref >> 1;
+			if ((ref & 1) && id > names.size()) return false;
+			if (id >= names.size()) names.resize(id + 1);
+			if ((ref & 1) && !get_string(p, end, names[id])) return false;
+			tag = names[id];
+			return true;
+		}
+
+		std::vector<char> buffer;
+		std::ifstream in;
+		std::string path;
+		uint64_t count;
+		uint64_t start;
+		uint64_t offset; // of the next record
+		std::vector<std::string> names;
+		std::string body;
+	};
+
+public:
+	static uint16_t encode(action a) {
+		switch (a.type()) {
+		case action::slide::type: return 0x8000 | (a.event() & 0b11);
+		case action::place::type: return action::place(a).position() | (action::place(a).tile() << 4);
+		default: return 0xffff;
+		}
+	}
+	static action decode(uint16_t code) {
+		if (code == 0xffff) return action();
+		if (code & 0x8000) return action::slide(code & 0b11);
+		return action::place(code & 0x0f, code >> 4);
+	}
+
+private:
+	static void put_move(std::string& out, const episode::move& mv) {
+		uint16_t code = encode(mv.code);
+		unsigned tile = code >> 4;
+		unsigned head = (code & 0x8000) ? (code == 0xffff ? 63 : 48 + (code & 0b11)) : (tile >= 1 && tile <= 3 ? code - 16 : 63);
+		out.push_back(char(head | (mv.reward ? 0x40 : 0) | (mv.time ? 0x80 : 0)));
+		if (head == 63) out.push_back(char(code & 0xff)), out.push_back(char(code >> 8));
+		if (mv.reward) put_varint(out, mv.reward);
+		if (mv.time) put_varint(out, mv.time);
+	}
+	static bool get_move(const char*& p, const char* end, episode::move& mv) {
+		if (p == end) return false;
+		uint8_t head = *(p++);
+		unsigned code = head & 63;
+		uint64_t reward = 0, time = 0;
+		if (code == 63) {
+			if (end - p < 2) return false;
+			mv.code = decode(uint8_t(p[0]) | (uint16_t(uint8_t(p[1])) << 8));
+			p += 2;
+		} else if (code >= 48) {
+			if (code > 51) return false;
+			mv.code = action::slide(code - 48);
+		} else {
+			mv.code = action::place(code & 15, (code >> 4) + 1);
+		}
+		if ((head & 0x40) && !get_varint(p, end, reward)) return false;
+		if ((head & 0x80) && !get_varint(p, end, time)) return false;
+		mv.reward = reward;
+		mv.time = time;
+		return true;
+	}
+
+	/**
+	 * apply a move without going through the action prototypes
+	 */
+	static void replay(action a, board& b) {
+		switch (a.type()) {
+		case action::slide::type: b.slide(a.event() & 0b11); break;
+		case action::place::type: b.place(action::place(a).position(), action::place(a).tile()); break;
+		default: break;
+		}
+	}
+
+	static void put_varint(std::string& out, uint64_t v) {
+		while (v >= 0x80) out.push_back(char(v | 0x80)), v >>= 7;
+		out.push_back(char(v));
+	}
+	static bool get_varint(const char*& p, const char* end, uint64_t& v) {
+		v = 0;
+		for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+			uint8_t c = *(p++);
+			v |= uint64_t(c & 0x7f) << shift;
+			if (!(c & 0x80)) return true;
+		}
+		return false;
+	}
+	static void put_string(std::string& out, const std::string& s) {
+		put_varint(out, s.size());
+		out.append(s);
+	}
+	static bool get_string(const char*& p, const char* end, std::string& s) {
+		uint64_t size;
+		if (!get_varint(p, end, size) || size > uint64_t(end - p)) return false;
+		s.assign(p, size);
+		p += size;
+		return true;
+	}
+};
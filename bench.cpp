@@ -0,0 +1,205 @@
+/**
+ * Microbenchmarks of the hot kernels
+ * use 'make bench' to build and run them
+ *
+ * every benchmark replays a fixed pool of boards collected from seeded self-play games,
+ * so two runs measure the same work; each result is printed as a JSON line, e.g.,
+ * {"name": "slide/up", "ns_per_op": 3.12, "ops_per_sec": 320512820, "iterations": 67108864}
+ *
+ * options:
+ *  --play=ARGS      player arguments (default "init=0 prefault=1"), e.g., "load=weights.bin"
+ *  --filter=NAME    run only the benchmarks whose name contains NAME
+ *  --time=SECONDS   minimum time of each measurement (default 0.2)
+ *  --repeat=N       measurements per benchmark, the median is reported (default 5)
+ *  --seed=N         seed of the board pool (default 0)
+ *  --boards=N       minimum size of the board pool (default 4096), a pool of about 1000000 boards
+ *                   touches more table entries than the last-level cache holds
+ *  --shuffle        visit the pool in a random order rather than move by move, so that
+ *                   consecutive boards share no table entries
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+#include "parallel.h"
+
+class benchmark {
+public:
+	benchmark(const std::string& filter, double time, unsigned repeat) : filter(filter), time(time), repeat(repeat) {}
+
+	/**
+	 * measure 'batch' calls of op (with an increasing index), each of which does 'width' operations,
+	 * the median of 'repeat' timings is reported; nothing is run if the batch is empty
+	 * (e.g., a V_batch size larger than the pool)
+	 */
+	template<typename operation>
+	void run(const std::string& name, size_t batch, operation op, size_t width = 1) {
+		if (name.find(filter) == std::string::npos || batch == 0) return;
+		size_t rounds = 1;
+		for (;;) { // find the number of batches which takes at least 'time'
+			if (measure(op, batch, rounds) >= time || rounds >= (size_t(1) << 40) / batch) break;
+			rounds *= 2;
+		}
+		std::vector<double> samples;
+		for (unsigned i = 0; i < repeat; i++) samples.push_back(measure(op, batch, rounds));
+		std::sort(samples.begin(), samples.end());
+		double seconds = samples[samples.size() / 2];
+		size_t n = batch * rounds * width;
+		double ns = seconds * 1e9 / n;
+		std::cout << "{\"name\": \"" << name << "\", \"ns_per_op\": " << ns << ", \"ops_per_sec\": "
+				<< size_t(n / seconds) << ", \"iterations\": " << n << "}" << std::endl;
+	}
+
+private:
+	template<typename operation>
+	static double measure(operation& op, size_t batch, size_t rounds) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t r = 0; r < rounds; r++)
+			for (size_t i = 0; i < batch; i++) op(i);
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::string filter;
+	double time;
+	unsigned repeat;
+};
+
+int main(int argc, const char* argv[]) {
+	std::string play_args = "init=0 prefault=1", filter;
+	double time = 0.2;
+	unsigned repeat = 5, seed = 0;
+	size_t boards = 4096;
+	bool shuffle = false;
+	for (int i = 1; i < argc; i++) {
+		std::string para(argv[i]);
+		if (para.find("--play=") == 0) {
+			play_args = para.substr(para.find("=") + 1);
+		} else if (para.find("--filter=") == 0) {
+			filter = para.substr(para.find("=") + 1);
+		} else if (para.find("--time=") == 0) {
+			time = std::stod(para.substr(para.find("=") + 1));
+		} else if (para.find("--repeat=") == 0) {
+			repeat = std::max(std::stoi(para.substr(para.find("=") + 1)), 1);
+		} else if (para.find("--boards=") == 0) {
+			boards = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--shuffle") == 0) {
+			shuffle = true;
+		} else if (para.find("--seed=") == 0) {
+			seed = std::stoul(para.substr(para.find("=") + 1));
+		}
+	}
+
+	player play(play_args + " alpha=0");
+	rndenv evil("seed=" + std::to_string(seed), &play);
+
+	// the pool: every board before a slide and every afterstate of the seeded games
+	std::vector<board> before, after;
+	std::vector<unsigned> ops;
+	for (size_t k = 0; before.size() < boards; k++) {
+		episode game;
+		worker_pool::play_episode(game, play, evil, k);
+		board b;
+		for (action a : game.actions()) {
+			if (a.type() == action::slide::type) {
+				before.push_back(b);
+				ops.push_back(a.event() & 0b11);
+			}
+			a.apply(b);
+			if (a.type() == action::slide::type) after.push_back(b);
+		}
+	}
+	const size_t n = before.size();
+	if (shuffle) {
+		rng::xoshiro256 random(seed);
+		for (size_t i = n; i > 1; i--) {
+			size_t j = random.below(i);
+			std::swap(before[i - 1], before[j]);
+			std::swap(after[i - 1], after[j]);
+			std::swap(ops[i - 1], ops[j]);
+		}
+	}
+	std::vector<std::pair<unsigned, unsigned>> places; // (position, tile) of an empty cell of each afterstate
+	for (const board& b : after) {
+		unsigned pos = 0;
+		while (pos < 15 && b(pos) != 0) pos++;
+		places.emplace_back(pos, 1 + places.size() % 3);
+	}
+
+	std::cout << "{\"bench\": \"threes\", \"play\": \"" << play_args << "\", \"seed\": " << seed
+			<< ", \"boards\": " << n << ", \"shuffle\": " << (shuffle ? "true" : "false") << ", \"simd\": \"" << simd::name(simd::select()) << "\"}" << std::endl;
+
+	benchmark bench(filter, time, repeat);
+	volatile uint64_t sink = 0;
+	const char* dirs[] = { "up", "right", "down", "left" };
+	for (unsigned op = 0; op < 4; op++) {
+		bench.run(std::string("slide/") + dirs[op], n, [&](size_t i) {
+			board b(before[i]);
+			sink += b.slide(op);
+			sink += b.raw();
+		});
+	}
+	bench.run("place", n, [&](size_t i) {
+		board b(after[i]);
+		sink += b.place(places[i].first, places[i].second);
+		sink += b.raw();
+	});
+	bench.run("action::apply", n, [&](size_t i) { // slides and places in turn, through the prototypes
+		board b(i & 1 ? after[i] : before[i]);
+		action a(i & 1 ? action(action::place(places[i].first, places[i].second)) : action(action::slide(ops[i])));
+		sink += a.apply(b);
+	});
+	bench.run("V_function", n, [&](size_t i) {
+		float v = play.WTF_weight_agent.V_function(after[i], false);
+		sink += uint64_t(v != 0);
+	});
+	const size_t width = play.WTF_weight_agent.width();
+	std::vector<uint32_t> known(n * width), scratch(width); // the indices of every board before its slide
+	for (size_t i = 0; i < n; i++) play.WTF_weight_agent.indices(before[i], &known[i * width]);
+	bench.run("indices", n, [&](size_t i) { // the extraction alone, from scratch
+		play.WTF_weight_agent.indices(after[i], scratch.data());
+		sink += scratch[0];
+	});
+	bench.run("indices/update", n, [&](size_t i) { // the extraction alone, patched from the board before the slide
+		std::copy(&known[i * width], &known[(i + 1) * width], scratch.begin());
+		play.WTF_weight_agent.update(after[i].raw() ^ before[i].raw(), scratch.data());
+		sink += scratch[0];
+	});
+	bench.run("V_function/update", n, [&](size_t i) {
+		std::copy(&known[i * width], &known[(i + 1) * width], scratch.begin());
+		play.WTF_weight_agent.update(after[i].raw() ^ before[i].raw(), scratch.data());
+		float v = play.WTF_weight_agent.V_function(scratch.data());
+		sink += uint64_t(v != 0);
+	});
+	std::vector<board::data> raws; // the afterstates as packed boards for V_batch
+	for (const board& b : after) raws.push_back(b.raw());
+	std::vector<float> values(n);
+	for (size_t size : { 1, 4, 16, 64, 256, 1024 }) { // boards per second against the batch size
+		bench.run("V_batch/" + std::to_string(size), n / size, [&](size_t i) {
+			play.WTF_weight_agent.V_batch(&raws[i * size], size, &values[i * size]);
+		}, size);
+	}
+	bench.run("V_function+weight_update", n, [&](size_t i) {
+		play.WTF_weight_agent.V_function(after[i], true);
+		play.WTF_weight_agent.weight_update(0.001f, 0.001f);
+	});
+	bench.run("rndenv::take_action", n, [&](size_t i) {
+		play.last_opcode = ops[i];
+		sink += unsigned(evil.take_action(after[i]));
+	});
+	bench.run("player::take_action", n, [&](size_t i) {
+		sink += unsigned(play.take_action(before[i]));
+	});
+	episode game;
+	size_t k = 0;
+	bench.run("episode", 1, [&](size_t) {
+		worker_pool::play_episode(game, play, evil, k++ % 1024);
+		sink += game.step();
+	});
+	return 0;
+}
@@ -1,14 +1,15 @@
 #pragma once
 #include <array>
+#include <cstdint>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
 #include <map>
 
 /**
- * array-based board for 2048
+ * bitboard for threes, 4-bit per cell packed in a 64-bit integer
  *
- * index (1-d form):
+ * index (1-d form), cell i is stored at bits [4i, 4i+4):
  *  (0)  (1)  (2)  (3)
  *  (4)  (5)  (6)  (7)
  *  (8)  (9) (10) (11)
@@ -35,11 +36,11 @@ std::map<uint32_t,int> tile_decode_table=
     {15,12288}
 };
 unsigned opcode_decode_table[4][8]=
-{//[op][board_flip]
-    {0,3,2,1,0,3,2,1},
-    {1,0,3,2,3,2,1,0},
-    {2,1,0,3,2,1,0,3},
-    {3,2,1,0,1,0,3,2},
+{//[op][board_flip], sliding op then Flip_board(flip) == Flip_board(flip) then sliding [op][flip]
+    {0,1,2,3,0,3,2,1},
+    {1,2,3,0,3,2,1,0},
+    {2,3,0,1,2,1,0,3},
+    {3,0,1,2,1,0,3,2},
 };
 
 class board {
@@ -51,18 +52,25 @@ public:
 	typedef int reward;
 
 public:
-	board() : tile(), attr(0){}
-	board(const grid& b, data v = 0) : tile(b), attr(v){}
+	board(data raw = 0, data v = 0) : tile(raw), attr(v) {}
+	board(const grid& b, data v = 0) : tile(0), attr(v) {
+		for (unsigned i = 0; i < 16; i++) set(i, b[i / 4][i % 4]);
+	}
 	board(const board& b) = default;
 	board& operator =(const board& b) = default;
 
-	operator grid&() { return tile; }
-	operator const grid&() const { return tile; }
-	row& operator [](unsigned i) { return tile[i]; }
-	const row& operator [](unsigned i) const { return tile[i]; }
-	cell& operator ()(unsigned i) { return tile[i / 4][i % 4]; }
-	const cell& operator ()(unsigned i) const { return tile[i / 4][i % 4]; }
+	operator grid() const {
+		grid g;
+		for (unsigned i = 0; i < 16; i++) g[i / 4][i % 4] = operator()(i);
+		return g;
+	}
+	row operator [](unsigned i) const {
+		return {{ operator()(i * 4), operator()(i * 4 + 1), operator()(i * 4 + 2), operator()(i * 4 + 3) }};
+	}
+	cell operator ()(unsigned i) const { return (tile >> (i << 2)) & 0x0f; }
+	void set(unsigned i, cell t) { tile = (tile & ~(data(0x0f) << (i << 2))) | (data(t & 0x0f) << (i << 2)); }
 
+	data raw() const { return tile; }
 	data info() const { return attr; }
 	data info(data dat) { data old = attr; attr = dat; return old; }
 
@@ -83,7 +91,7 @@ public:
 	reward place(unsigned pos, cell tile) {
 		if (pos >= 16) return -1;
 		if (tile != 1 && tile != 2&& tile!=3) return -1;
-		operator()(pos) = tile;
+		set(pos, tile);
 		return 0;
 	}
 
@@ -101,79 +109,74 @@ public:
 		}
 	}
 
+	/**
+	 * each slide is four lookups, one per row (left/right) or column (up/down)
+	 * the tables store the xor delta of the line, so the line changed iff delta != 0
+	 */
 	reward slide_left() {
-		board prev = *this;
+		const lookup& lut = lookup::table();
+		data delta = 0;
 		reward score = 0;
-		for (int r = 0; r < 4; r++) {
-			auto& row = tile[r];
-            uint32_t hold=row[0];
-			for (int c = 1; c < 4; c++) {
-                if(hold==0){
-                    row[c-1]=row[c];
-                    row[c]=0;
-                    continue;
-                }
-                if (hold!=0) {
-                    int sum=row[c]+hold;
-                    if (sum==3){
-                        row[c-1]=sum;
-                        score += sum;
-                        row[c]=0;
-                        hold=0;
-                    }
-                    else if (row[c] == hold && row[c]>=3) {
-                        row[c-1]+=1;
-                        score += tile_decode_table[sum];
-                        row[c]=0;
-                        hold=0;
-                    }
-                    else {
-                        hold=row[c];
-                    }
-                }
-			}
+		for (unsigned r = 0; r < 64; r += 16) {
+			unsigned line = (tile >> r) & 0xffff;
+			delta |= data(lut.left[line]) << r;
+			score += lut.score_left[line];
 		}
-		return (*this != prev) ? score : -1;
+		tile ^= delta;
+		return delta ? score : -1;
 	}
 	reward slide_right() {
-		reflect_horizontal();
-		reward score = slide_left();
-		reflect_horizontal();
-		return score;
+		const lookup& lut = lookup::table();
+		data delta = 0;
+		reward score = 0;
+		for (unsigned r = 0; r < 64; r += 16) {
+			unsigned line = (tile >> r) & 0xffff;
+			delta |= data(lut.right[line]) << r;
+			score += lut.score_right[line];
+		}
+		tile ^= delta;
+		return delta ? score : -1;
 	}
 	reward slide_up() {
-		rotate_right();
-		reward score = slide_right();
-		rotate_left();
-		return score;
+		const lookup& lut = lookup::table();
+		data delta = 0;
+		reward score = 0;
+		for (unsigned c = 0; c < 16; c += 4) {
+			unsigned line = column(tile >> c);
+			delta |= lut.up[line] << c;
+			score += lut.score_left[line];
+		}
+		tile ^= delta;
+		return delta ? score : -1;
 	}
 	reward slide_down() {
-		rotate_right();
-		reward score = slide_left();
-		rotate_left();
-		return score;
+		const lookup& lut = lookup::table();
+		data delta = 0;
+		reward score = 0;
+		for (unsigned c = 0; c < 16; c += 4) {
+			unsigned line = column(tile >> c);
+			delta |= lut.down[line] << c;
+			score += lut.score_right[line];
+		}
+		tile ^= delta;
+		return delta ? score : -1;
 	}
 
 	void transpose() {
-		for (int r = 0; r < 4; r++) {
-			for (int c = r + 1; c < 4; c++) {
-				std::swap(tile[r][c], tile[c][r]);
-			}
-		}
+		tile = (tile & 0xf0000f0000f0000full)
+		     | ((tile & 0x0000f0000f0000f0ull) << 12) | ((tile & 0x0f0000f0000f0000ull) >> 12)
+		     | ((tile & 0x00000000f0000f00ull) << 24) | ((tile & 0x00f0000f00000000ull) >> 24)
+		     | ((tile & 0x000000000000f000ull) << 36) | ((tile & 0x000f000000000000ull) >> 36);
 	}
 
 	void reflect_horizontal() {
-		for (int r = 0; r < 4; r++) {
-			std::swap(tile[r][0], tile[r][3]);
-			std::swap(tile[r][1], tile[r][2]);
-		}
+		tile = ((tile & 0x000f000f000f000full) << 12) | ((tile & 0x00f000f000f000f0ull) << 4)
+		     | ((tile & 0x0f000f000f000f00ull) >> 4) | ((tile & 0xf000f000f000f000ull) >> 12);
 	}
 
 	void reflect_vertical() {
-		for (int c = 0; c < 4; c++) {
-			std::swap(tile[0][c], tile[3][c]);
-			std::swap(tile[1][c], tile[2][c]);
-		}
+		tile = ((tile & 0x000000000000ffffull) << 48) | ((tile & 0x00000000ffff0000ull) << 16)
+		     | ((tile & 0x0000ffff00000000ull) >> 16) | ((tile & 0xffff000000000000ull) >> 48);
 	}
 
 	/**
@@ -208,31 +211,36 @@ public:
 	void rotate_left() { transpose(); reflect_vertical(); } // counterclockwise
 	void reverse() { reflect_horizontal(); reflect_vertical(); }
     
-    void initboard(){
+    /**
+     * place three tiles of each of 1, 2, 3 on distinct random cells, 'engine' draws bounded numbers
+     * (e.g., rng::xoshiro256); only the 9 cells which are used are shuffled
+     */
+    template<typename random>
+    void initboard(random& engine){
         std::array<int, 16> space={ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
         std::array<cell, 9> initbag={1,1,1,2,2,2,3,3,3};
-        std::random_shuffle(space.begin(),space.end());
-        for(int i=0;i<9;i++){
-            int pos=space[i];
-            operator()(pos)=initbag[i];
+        for(unsigned i=0;i<9;i++){
+            std::swap(space[i], space[i + engine.below(16 - i)]);
+            set(space[i], initbag[i]);
         }
-    
     }
     void clear(){
-        for(unsigned i=0;i<16;i++)this->operator()(i)=0;
+        tile = 0;
     }
     
-    uint32_t& max_tile(){
-        return *std::max_element(&(this->operator()(0)), &(this->operator()(16)));
+    cell max_tile() const {
+        cell max = 0;
+        for (data t = tile; t; t >>= 4) max = std::max(max, cell(t & 0x0f));
+        return max;
     }
     
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const board& b) {
 		out << "+------------------------+" << std::endl;
-		for (auto& row : b.tile) {
+		for (unsigned r = 0; r < 4; r++) {
 			out << "|" << std::dec;
-        for (auto t : row) out << std::setw(6) << tile_decode_table[t];
+        for (auto t : b[r]) out << std::setw(6) << tile_decode_table[t];
 			out << "|" << std::endl;
 		}
 		out << "+------------------------+" << std::endl;
@@ -240,6 +248,92 @@ public:
 	}
 
 private:
-	grid tile;
+	/**
+	 * gather column 0 of a packed board (cells 0, 4, 8, 12) into a 16-bit line
+	 */
+	static unsigned column(data t) {
+		t &= 0x000f000f000f000full;
+		return (t | (t >> 12) | (t >> 24) | (t >> 36)) & 0xffff;
+	}
+	/**
+	 * scatter a 16-bit line back to column 0 of a packed board
+	 */
+	static data spread(unsigned line) {
+		data t = line;
+		t = (t | (t << 24)) & 0x000000ff000000ffull;
+		t = (t | (t << 12)) & 0x000f000f000f000full;
+		return t;
+	}
+
+	/**
+	 * precomputed results of sliding every possible 16-bit line
+	 * a line holds 4 cells, the first cell in the lowest nibble
+	 */
+	struct lookup {
+		std::array<uint16_t, 65536> left;
+		std::array<uint16_t, 65536> right;
+		std::array<data, 65536> up;
+		std::array<data, 65536> down;
+		std::array<reward, 65536> score_left;
+		std::array<reward, 65536> score_right;
+
+		lookup() {
+			for (unsigned line = 0; line < 65536; line++) {
+				unsigned rev = ((line & 0x000f) << 12) | ((line & 0x00f0) << 4) | ((line & 0x0f00) >> 4) | ((line & 0xf000) >> 12);
+				unsigned res_left = line, res_right = rev;
+				score_left[line] = slide_line(res_left);
+				score_right[line] = slide_line(res_right);
+				res_right = ((res_right & 0x000f) << 12) | ((res_right & 0x00f0) << 4) | ((res_right & 0x0f00) >> 4) | ((res_right & 0xf000) >> 12);
+				left[line] = line ^ res_left;
+				right[line] = line ^ res_right;
+				up[line] = spread(left[line]);
+				down[line] = spread(right[line]);
+			}
+		}
+
+		/**
+		 * slide a line toward its first cell, return the reward of the line
+		 * a pair of 12288-tiles is not merged since it cannot fit in a cell
+		 */
+		static reward slide_line(unsigned& line) {
+			cell row[4];
+			for (int c = 0; c < 4; c++) row[c] = (line >> (c * 4)) & 0x0f;
+			reward score = 0;
+			cell hold = row[0];
+			for (int c = 1; c < 4; c++) {
+				if (hold == 0) {
+					row[c-1] = row[c];
+					row[c] = 0;
+					continue;
+				}
+				cell sum = row[c] + hold;
+				if (sum == 3) {
+					row[c-1] = sum;
+					score += sum;
+					row[c] = 0;
+					hold = 0;
+				}
+				else if (row[c] == hold && row[c] >= 3 && row[c] < 15) {
+					row[c-1] += 1;
+					score += (sum < 16) ? tile_decode_table[sum] : 0;
+					row[c] = 0;
+					hold = 0;
+				}
+				else {
+					hold = row[c];
+				}
+			}
+			line = row[0] | (row[1] << 4) | (row[2] << 8) | (row[3] << 12);
+			return score;
+		}
+
+		static const lookup& table() {
+			static const lookup lut;
+			return lut;
+		}
+	};
+
+private:
+	data tile;
 	data attr;
 };
@@ -0,0 +1,176 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "weight.h"
+
+/**
+ * periodic checkpoints of the weights during training
+ *
+ * a checkpoint forks the process: the child holds a copy-on-write snapshot of the tables as they
+ * are at the fork and writes it (to a temporary file renamed over the target), while the parent keeps
+ * on playing; the parent pays for the fork, and then for a copy of every page it writes while the
+ * child lives, so its throughput while a checkpoint is written is compared with its throughput between
+ * checkpoints; a background thread reaps the child and records the latencies, and a checkpoint is
+ * skipped if the previous one is still being written
+ *
+ * the child of a multithreaded process may only make system calls (another thread may have held the
+ * allocator's lock at the fork), so the file is laid out by weight_file::image before the fork
+ */
+class checkpoint {
+public:
+	/**
+	 * parse the period, a number of games (e.g., 100000) or of seconds (e.g., 600s)
+	 */
+	checkpoint(const std::string& path, const std::string& period) : path(path), games(0), seconds(0),
+		count(0), played(0), busy(false), last(std::chrono::steady_clock::now().time_since_epoch().count()), stats({}),
+		since(std::chrono::steady_clock::now()), moved(0) {
+		if (period.size() && period.back() == 's') seconds = std::stod(period.substr(0, period.size() - 1));
+		else games = std::stoull(period);
+		if (games == 0 && seconds <= 0) throw std::invalid_argument("bad checkpoint period: " + period);
+	}
+	~checkpoint() { wait(); }
+
+	/**
+	 * count a finished episode of the given number of moves, true if a checkpoint is due
+	 */
+	bool due(size_t moves = 0) {
+		played += moves;
+		size_t n = ++count;
+		if (games) return n % games == 0;
+		using clock = std::chrono::steady_clock;
+		clock::rep now = clock::now().time_since_epoch().count(), then = last.load(std::memory_order_relaxed);
+		return std::chrono::duration<double>(clock::duration(now - then)).count() >= seconds
+			&& last.compare_exchange_strong(then, now); // only one thread takes it
+	}
+
+	/**
+	 * fork a writer of the tables, unless the previous one is still running
+	 */
+	void take(const std::vector<weight>& net, uint32_t iso, const std::vector<ntuple>& tuples) {
+		std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+		if (!guard.owns_lock()) return; // another thread is taking it
+		if (busy) {
+			stats.skipped++;
+			return;
+		}
+		if (waiter.joinable()) waiter.join(); // it has finished, as busy is cleared
+		weight_file::image file(path, net, iso, tuples);
+		auto start = std::chrono::steady_clock::now();
+		size_t moves = played.load();
+		pid_t pid = ::fork();
+		if (pid == 0) { // the snapshot, write it at a lower priority and leave without running any destructor
+			if (::nice(10) == -1) {} // best effort
+			::_exit(file.write() ? 0 : 1);
+		}
+		auto forked = std::chrono::steady_clock::now();
+		if (pid < 0) {
+			stats.failed++;
+			return;
+		}
+		record(stats.fork, forked - start);
+		record(stats.between, moves - moved, start - since);
+		busy = true;
+		waiter = std::thread([this, pid, start, moves]() {
+			int status = 0;
+			while (::waitpid(pid, &status, 0) < 0 && errno == EINTR);
+			std::lock_guard<std::mutex> guard(lock);
+			since = std::chrono::steady_clock::now();
+			moved = played.load();
+			record(stats.write, since - start);
+			record(stats.during, moved - moves, since - start);
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) stats.written++;
+			else stats.failed++;
+			busy = false;
+		});
+	}
+
+	/**
+	 * wait for the checkpoint being written, if any
+	 */
+	void wait() {
+		std::thread last;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			last.swap(waiter);
+		}
+		if (last.joinable()) last.join();
+	}
+
+	/**
+	 * print the checkpoints since the last report, e.g.,
+	 * 	checkpoint: 2 written, 0 skipped, 0 failed, fork = 1.21 ms (max 1.52 ms), write = 812 ms (max 905 ms), moves/s = 402210 while writing, 436155 between (-7.8%)
+	 * where fork is the time the play loop is stalled, write is the time until the file is renamed,
+	 * and the moves per second while writing include the copy-on-write faults taken by the parent
+	 */
+	void report(std::ostream& out) {
+		summary s;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			s = stats;
+			stats = {};
+		}
+		if (s.fork.n + s.write.n + s.skipped + s.failed == 0) return;
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << std::setprecision(3);
+		out << "\t" << "checkpoint: " << s.written << " written, " << s.skipped << " skipped, " << s.failed << " failed";
+		if (s.fork.n) out << ", fork = " << (s.fork.sum / s.fork.n) << " ms (max " << s.fork.max << " ms)";
+		if (s.write.n) out << ", write = " << (s.write.sum / s.write.n) << " ms (max " << s.write.max << " ms)";
+		if (s.during.seconds > 0 && s.between.seconds > 0) {
+			double during = s.during.moves / s.during.seconds, between = s.between.moves / s.between.seconds;
+			out << std::fixed << std::setprecision(0) << ", moves/s = " << during << " while writing, " << between << " between";
+			out << " (" << std::showpos << std::setprecision(1) << ((during - between) * 100 / std::max(between, 1e-9)) << "%)";
+		}
+		out << std::endl;
+		out.copyfmt(ff);
+	}
+
+private:
+	struct latency {
+		size_t n;
+		double sum, max; // in milliseconds
+	};
+	struct throughput {
+		size_t moves;
+		double seconds;
+	};
+	struct summary {
+		size_t written, skipped, failed;
+		latency fork, write;
+		throughput during, between; // while a checkpoint is written, and between the checkpoints
+	};
+
+	static void record(latency& l, std::chrono::steady_clock::duration d) {
+		double ms = std::chrono::duration<double, std::milli>(d).count();
+		l.n++;
+		l.sum += ms;
+		l.max = std::max(l.max, ms);
+	}
+	static void record(throughput& t, size_t moves, std::chrono::steady_clock::duration d) {
+		t.moves += moves;
+		t.seconds += std::chrono::duration<double>(d).count();
+	}
+
+	std::string path;
+	size_t games;
+	double seconds;
+	std::atomic<size_t> count;
+	std::atomic<size_t> played; // the moves of the counted episodes
+	bool busy;
+	std::atomic<std::chrono::steady_clock::rep> last; // the time of the last checkpoint, if the period is in seconds
+	summary stats;
+	std::chrono::steady_clock::time_point since; // when the last checkpoint was written
+	size_t moved; // the moves played by then
+	std::mutex lock;
+	std::thread waiter;
+};
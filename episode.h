@@ -6,14 +6,18 @@
 #include <sstream>
 #include <chrono>
 #include <numeric>
+#include <cctype>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
+#include "profile.h"
 
 class statistic;
+class archive;
 
 class episode {
 friend class statistic;
+friend class archive;
 public:
 	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) { ep_moves.reserve(10000);}
 
@@ -22,21 +26,31 @@ public:
 	const board& state() const { return ep_state; }
 	board::reward score() const { return ep_score; }
 
+	/**
+	 * start from the initial state, the move storage is kept so that an episode can be reused
+	 */
 	void open_episode(const std::string& tag) {
-		ep_open = { tag, millisec() };
+		ep_state = initial_state();
+		ep_score = 0;
+		ep_moves.clear();
+		ep_open.tag.assign(tag);
+		ep_open.when = microsec();
 	}
 	void close_episode(const std::string& tag) {
-		ep_close = { tag, millisec() };
+		ep_close.tag.assign(tag);
+		ep_close.when = microsec();
 	}
 	bool apply_action(action move) {
+		time_t elapsed = steady() - ep_time;
+		profile::scope timer(profile::bookkeeping);
 		board::reward reward = move.apply(state());
 		if (reward == -1) return false;
-		ep_moves.emplace_back(move, reward, millisec() - ep_time);
+		ep_moves.emplace_back(move, reward, elapsed);
 		ep_score += reward;
 		return true;
 	}
 	agent& take_turns(agent& play, agent& evil) {
-		ep_time = millisec();
+		ep_time = steady();
 		return (std::max(step(), size_t(8)) % 2) ? play : evil;
 	}
 	agent& last_turns(agent& play, agent& evil) {
@@ -89,6 +103,25 @@ public:
 
 public:
 
+	/**
+	 * the text format writes a time in milliseconds with the microseconds as decimals, e.g., 12.034,
+	 * so that the logs written before the decimals, in whole milliseconds, are still read the same
+	 */
+	static std::ostream& put_time(std::ostream& out, time_t time) {
+		out << std::dec << (time / 1000);
+		if (time % 1000) out << '.' << char('0' + time % 1000 / 100) << char('0' + time % 100 / 10) << char('0' + time % 10);
+		return out;
+	}
+	static std::istream& get_time(std::istream& in, time_t& time) {
+		in >> std::dec >> time;
+		time *= 1000;
+		if (in.peek() == '.') {
+			in.ignore(1);
+			for (time_t unit = 100; std::isdigit(in.peek()); unit /= 10) time += (in.get() - '0') * unit;
+		}
+		return in;
+	}
+
 	friend std::ostream& operator <<(std::ostream& out, const episode& ep) {
 		out << ep.ep_open << '|';
 		for (const move& mv : ep.ep_moves) out << mv;
@@ -123,7 +156,7 @@ protected:
 		friend std::ostream& operator <<(std::ostream& out, const move& m) {
 			out << m.code;
 			if (m.reward) out << '[' << std::dec << m.reward << ']';
-			if (m.time) out << '(' << std::dec << m.time << ')';
+			if (m.time) put_time(out << '(', m.time) << ')';
 			return out;
 		}
 		friend std::istream& operator >>(std::istream& in, move& m) {
@@ -137,7 +170,7 @@ protected:
 			}
 			if (in.peek() == '(') {
 				in.ignore(1);
-				in >> std::dec >> m.time;
+				get_time(in, m.time);
 				in.ignore(1);
 			}
 			return in;
@@ -150,19 +183,27 @@ protected:
 		meta(const std::string& tag = "N/A", time_t when = 0) : tag(tag), when(when) {}
 
 		friend std::ostream& operator <<(std::ostream& out, const meta& m) {
-			return out << m.tag << "@" << std::dec << m.when;
+			return put_time(out << m.tag << "@", m.when);
 		}
 		friend std::istream& operator >>(std::istream& in, meta& m) {
-			return std::getline(in, m.tag, '@') >> std::dec >> m.when;
+			return get_time(std::getline(in, m.tag, '@'), m.when);
 		}
 	};
 
 	static board initial_state() {
         return {};
 	}
-	static time_t millisec() {
+	/**
+	 * all times are kept in microseconds: the wall clock stamps the episode and the
+	 * monotonic clock times the moves (the text format writes them in milliseconds)
+	 */
+	static time_t microsec() {
 		auto now = std::chrono::system_clock::now().time_since_epoch();
-		return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+		return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+	}
+	static time_t steady() {
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
 	}
 
 private:
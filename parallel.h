@@ -0,0 +1,170 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+#include "statistic.h"
+
+/**
+ * player/environment pairs for parallel play
+ *
+ * the first pair uses the master player, the others use copies of it,
+ * which share the weight tables of the master
+ * the environment is reseeded with the episode index before each episode,
+ * so episode k is the same game no matter which thread plays it
+ */
+class worker_pool {
+public:
+	worker_pool(player& master, const std::string& evil_args, size_t threads) {
+		plays.push_back(&master);
+		for (size_t i = 1; i < threads; i++) {
+			copies.emplace_back(new player(master));
+			plays.push_back(copies.back().get());
+		}
+		for (size_t i = 0; i < threads; i++) {
+			evils.emplace_back(new rndenv(evil_args, plays[i]));
+		}
+	}
+
+	/**
+	 * play the k-th episode, this is the same game loop used in main
+	 */
+	static void play_episode(episode& game, player& play, rndenv& evil, size_t k) {
+		evil.fork(k);
+		play.open_episode("~:" + evil.name());
+		evil.open_episode(play.name() + ":~");
+		game.open_episode(play.name() + ":" + evil.name());
+		while (true) {
+			agent& who = game.take_turns(play, evil);
+			action move = who.take_action(game.state());
+			if (game.apply_action(move) != true) break;
+			if (who.check_for_win(game.state())) break;
+		}
+		agent& win = game.last_turns(play, evil);
+		game.close_episode(win.name());
+		play.close_episode(win.name());
+		evil.close_episode(win.name());
+	}
+
+protected:
+	std::vector<player*> plays;
+	std::vector<std::unique_ptr<player>> copies;
+	std::vector<std::unique_ptr<rndenv>> evils;
+};
+
+/**
+ * Hogwild-style parallel self-play
+ *
+ * all players update the shared weight tables without locks
+ * finished episodes are handed over to the statistic in completion order
+ */
+class selfplay : public worker_pool {
+public:
+	selfplay(player& master, const std::string& evil_args, size_t threads)
+		: worker_pool(master, evil_args, threads) {}
+
+	/**
+	 * play until the statistic is finished
+	 */
+	void run(statistic& stat) {
+		size_t first = stat.episodes(), total = stat.remaining();
+		std::atomic<size_t> next(0);
+		std::mutex lock;
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < plays.size(); i++) {
+			workers.emplace_back([&, i]() {
+				player& play = *plays[i];
+				rndenv& evil = *evils[i];
+				episode game; // swapped with a recycled episode by push_episode
+				for (size_t k; (k = next++) < total; ) {
+					play_episode(game, play, evil, first + k);
+					std::lock_guard<std::mutex> guard(lock);
+					stat.push_episode(game);
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+	}
+};
+
+/**
+ * parallel evaluation with read-only weights
+ *
+ * episodes are dealt round-robin to per-thread stripes, each handed out by
+ * an atomic counter; a thread takes the next episode of its own stripe and
+ * steals the next one of another stripe when its own runs dry, which
+ * balances episodes of very different lengths
+ * finished episodes are committed to the statistic in episode order,
+ * so the summary is identical to a serial run with the same seed
+ * a thread does not start an episode more than 'window' episodes ahead of
+ * the next one to commit, but waits, so episode k can be played in the slot
+ * k % window of a fixed ring, whose episodes are recycled by the statistic
+ */
+class evaluation : public worker_pool {
+public:
+	evaluation(player& master, const std::string& evil_args, size_t threads)
+		: worker_pool(master, evil_args, threads), stripes(threads), window(threads * 4), slots(window), ready(window) {}
+
+	/**
+	 * play until the statistic is finished
+	 */
+	void run(statistic& stat) {
+		size_t first = stat.episodes(), total = stat.remaining();
+		for (std::atomic<size_t>& next : stripes) next = 0;
+
+		size_t commit = 0;
+		std::mutex lock;
+		std::condition_variable committed;
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < plays.size(); i++) {
+			workers.emplace_back([&, i]() {
+				player& play = *plays[i];
+				rndenv& evil = *evils[i];
+				for (size_t k; take(i, total, k); ) {
+					{ // the episode at 'commit' is played by a thread which does not wait, as the stripes are in order
+						std::unique_lock<std::mutex> guard(lock);
+						committed.wait(guard, [&]() { return k < commit + window; });
+					}
+					play_episode(slots[k % window], play, evil, first + k); // the slot was committed 'window' episodes ago
+					std::lock_guard<std::mutex> guard(lock);
+					ready[k % window] = true;
+					size_t from = commit;
+					for (; ready[commit % window]; commit++) {
+						ready[commit % window] = false;
+						stat.push_episode(slots[commit % window]);
+					}
+					if (commit != from) committed.notify_all();
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+	}
+
+private:
+	/**
+	 * take the next episode of stripe i, steal the next one of another stripe if its own is done
+	 * return false if there is no work left at all
+	 */
+	bool take(size_t i, size_t total, size_t& k) {
+		size_t threads = stripes.size();
+		for (size_t n = 0; n < threads; n++) {
+			size_t s = (i + n) % threads;
+			if (s + threads * stripes[s].load() >= total) continue;
+			k = s + threads * stripes[s]++;
+			if (k < total) return true;
+		}
+		return false;
+	}
+
+	std::vector<std::atomic<size_t>> stripes; // the episodes taken from each stripe
+	size_t window; // the most episodes played or held ahead of the next one to commit
+	std::vector<episode> slots;
+	std::vector<char> ready; // guarded by the lock of run
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * hardware performance counters through perf_event_open
+ *
+ * the counters count the user space of this process from their construction on, and
+ * threads created later are inherited (their counts are added when they exit);
+ * a counter which cannot be opened (e.g., in a VM or with perf_event_paranoid > 2)
+ * is reported as unavailable instead of failing the run
+ */
+namespace perf {
+
+enum event { cycles, instructions, l1d_misses, llc_misses, dtlb_misses, branch_misses, events };
+
+inline const char* name(event e) {
+	static const char* names[] = { "cycles", "instructions", "L1d-misses", "LLC-misses", "dTLB-misses", "branch-misses" };
+	return names[e];
+}
+
+class counters {
+public:
+	counters() : last({}) {
+		for (unsigned e = 0; e < events; e++) fd[e] = open(event(e));
+		last = read();
+	}
+	counters(const counters&) = delete;
+	counters& operator =(const counters&) = delete;
+	~counters() {
+		for (int f : fd) if (f >= 0) close(f);
+	}
+
+	/**
+	 * whether any counter is open, otherwise 'error' tells why the first one failed
+	 */
+	bool available() const {
+		for (int f : fd) if (f >= 0) return true;
+		return false;
+	}
+
+	/**
+	 * the counts so far, scaled up when the kernel multiplexed the counters
+	 */
+	std::array<uint64_t, events> read() const {
+		std::array<uint64_t, events> value = {};
+		for (unsigned e = 0; e < events; e++) {
+			uint64_t buf[3] = {}; // value, time enabled, time running
+			if (fd[e] < 0 || ::read(fd[e], buf, sizeof(buf)) != sizeof(buf)) continue;
+			value[e] = buf[2] ? uint64_t(double(buf[0]) * buf[1] / buf[2]) : 0;
+		}
+		return value;
+	}
+
+	/**
+	 * print the counts since the last report, in total and per move, e.g.,
+	 * 	cycles          = 1.52e+09, 1.95e+03/move
+	 * 	instructions    = 2.41e+09, 3.09e+03/move, IPC = 1.59
+	 */
+	void report(std::ostream& out, uint64_t moves) {
+		std::array<uint64_t, events> now = read();
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << std::setprecision(3);
+		for (unsigned e = 0; e < events; e++) {
+			out << "\t" << std::left << std::setw(16) << name(event(e)) << std::right << "= ";
+			if (fd[e] < 0) {
+				out << "n/a" << std::endl;
+				continue;
+			}
+			double n = now[e] - last[e];
+			out << n << ", " << (moves ? n / moves : 0) << "/move";
+			if (e == instructions && fd[cycles] >= 0 && now[cycles] > last[cycles])
+				out << ", IPC = " << n / (now[cycles] - last[cycles]);
+			out << std::endl;
+		}
+		out.copyfmt(ff);
+		last = now;
+	}
+
+	std::string error;
+
+private:
+	int open(event e) {
+		static const uint64_t cache[] = { // PERF_TYPE_HW_CACHE config: cache | op << 8 | result << 16
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		};
+		struct perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		switch (e) {
+		case cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case branch_misses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		default: attr.type = PERF_TYPE_HW_CACHE; attr.config = cache[e - l1d_misses]; break;
+		}
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int f = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (f < 0 && error.empty()) error = std::string(name(e)) + ": " + std::strerror(errno);
+		return f;
+	}
+
+	std::array<int, events> fd;
+	std::array<uint64_t, events> last;
+};
+
+} // namespace perf
@@ -0,0 +1,169 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <x86intrin.h>
+
+/**
+ * per-phase latency instrumentation
+ *
+ * a phase is timed with the TSC by a scope guard, and the elapsed ticks are added to a
+ * log-linear histogram (4 buckets per power of two) of the calling thread; a report merges
+ * the histograms of all threads, prints p50/p99/max in nanoseconds and starts a new block
+ *
+ * nothing is timed unless profile::enabled() is set, a disabled scope costs one branch
+ */
+namespace profile {
+
+enum phase { slide, evaluate, update, environment, bookkeeping, phases };
+
+inline const char* name(phase p) {
+	static const char* names[] = { "slide", "V_function", "weight_update", "environment", "bookkeeping" };
+	return names[p];
+}
+
+inline bool& enabled() {
+	static bool on = false;
+	return on;
+}
+
+/**
+ * nanoseconds per TSC tick, calibrated against steady_clock
+ */
+inline double tick() {
+	static double ns = []() {
+		auto t0 = std::chrono::steady_clock::now();
+		uint64_t c0 = __rdtsc();
+		while (std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(20));
+		uint64_t c1 = __rdtsc();
+		auto t1 = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(t1 - t0).count() / double(c1 - c0);
+	}();
+	return ns;
+}
+
+class histogram {
+public:
+	static const size_t size = 4 * 64;
+
+	histogram() { for (auto& c : counts) c = 0; top = 0; }
+
+	void add(uint64_t ticks) {
+		counts[bucket(ticks)].fetch_add(1, std::memory_order_relaxed);
+		if (ticks > top.load(std::memory_order_relaxed)) top.store(ticks, std::memory_order_relaxed);
+	}
+
+	/**
+	 * move the counts into a plain array (the histogram restarts), return the maximum
+	 */
+	uint64_t drain(std::array<uint64_t, size>& into) {
+		for (size_t i = 0; i < size; i++) into[i] += counts[i].exchange(0, std::memory_order_relaxed);
+		return top.exchange(0, std::memory_order_relaxed);
+	}
+
+	static size_t bucket(uint64_t v) {
+		if (v < 4) return v;
+		unsigned e = 63 - __builtin_clzll(v);
+		return (e - 1) * 4 + ((v >> (e - 2)) & 3);
+	}
+	static double midpoint(size_t b) {
+		if (b < 4) return b;
+		unsigned e = b / 4 + 1;
+		return double((uint64_t(4 + (b % 4)) << (e - 2)) + ((uint64_t(1) << (e - 2)) >> 1));
+	}
+
+	/**
+	 * the value at quantile q of drained counts, and the number of values
+	 */
+	static double quantile(const std::array<uint64_t, size>& counts, double q) {
+		uint64_t n = total(counts), rank = std::max(uint64_t(q * n + 0.5), uint64_t(1)), accu = 0;
+		for (size_t b = 0; b < size; b++)
+			if ((accu += counts[b]) >= rank) return midpoint(b);
+		return 0;
+	}
+	static uint64_t total(const std::array<uint64_t, size>& counts) {
+		uint64_t n = 0;
+		for (uint64_t c : counts) n += c;
+		return n;
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, size> counts;
+	std::atomic<uint64_t> top;
+};
+
+/**
+ * the histograms of a thread, registered on first use and kept for the whole run
+ */
+struct recorder {
+	std::array<histogram, phases> phase;
+
+	static std::vector<recorder*>& all() {
+		static std::vector<recorder*> list;
+		return list;
+	}
+	static std::mutex& lock() {
+		static std::mutex m;
+		return m;
+	}
+	static recorder& local() {
+		static thread_local recorder* self = nullptr;
+		if (!self) {
+			self = new recorder();
+			std::lock_guard<std::mutex> guard(lock());
+			all().push_back(self);
+		}
+		return *self;
+	}
+};
+
+/**
+ * time the enclosing scope as the given phase
+ */
+class scope {
+public:
+	scope(phase p) : p(p), start(enabled() ? __rdtsc() : 0) {}
+	~scope() { if (start) recorder::local().phase[p].add(__rdtsc() - start); }
+private:
+	phase p;
+	uint64_t start;
+};
+
+/**
+ * print the latency of each phase since the last report, e.g.,
+ * 	slide           p50 = 9 ns, p99 = 24 ns, max = 3.1 us, n = 1024000
+ */
+inline void report(std::ostream& out) {
+	std::array<std::array<uint64_t, histogram::size>, phases> merged = {};
+	std::array<uint64_t, phases> top = {};
+	{
+		std::lock_guard<std::mutex> guard(recorder::lock());
+		for (recorder* r : recorder::all())
+			for (unsigned p = 0; p < phases; p++) top[p] = std::max(top[p], r->phase[p].drain(merged[p]));
+	}
+	auto time = [&](double ns) -> std::ostream& {
+		if (ns < 1e3) return out << ns << " ns";
+		if (ns < 1e6) return out << (ns / 1e3) << " us";
+		return out << (ns / 1e6) << " ms";
+	};
+	std::ios ff(nullptr);
+	ff.copyfmt(out);
+	out << std::setprecision(3);
+	for (unsigned p = 0; p < phases; p++) {
+		uint64_t n = histogram::total(merged[p]);
+		if (n == 0) continue;
+		out << "\t" << std::left << std::setw(16) << name(phase(p)) << std::right;
+		out << "p50 = "; time(histogram::quantile(merged[p], 0.5) * tick()) << ", ";
+		out << "p99 = "; time(histogram::quantile(merged[p], 0.99) * tick()) << ", ";
+		out << "max = "; time(top[p] * tick()) << ", ";
+		out << "n = " << n << std::endl;
+	}
+	out.copyfmt(ff);
+}
+
+} // namespace profile
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+
+/**
+ * fast random streams for the environment and the agents
+ *
+ * xoshiro256** generates the numbers, and its state is derived from a (seed, stream) pair with
+ * splitmix64 instead of being carried over, so stream k of a seed (e.g., the k-th episode) is the
+ * same sequence whichever thread draws it and however many numbers the other streams have drawn
+ */
+namespace rng {
+
+/**
+ * the splitmix64 finalizer, a bijection of 64-bit words whose outputs look independent
+ */
+inline uint64_t mix(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+class xoshiro256 {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	xoshiro256(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+	/**
+	 * start the given stream of a seed
+	 */
+	void seed(uint64_t seed, uint64_t stream = 0) {
+		uint64_t key = mix(mix(seed) + stream);
+		for (unsigned i = 0; i < 4; i++) s[i] = mix(key + (i + 1) * 0x9e3779b97f4a7c15ull); // distinct, so never all zero
+	}
+
+	result_type operator ()() {
+		uint64_t result = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+	/**
+	 * a uniform number in [0, n), by multiplying the high 32 bits by n (Lemire's method),
+	 * the rare biased draws are rejected with a division only when one is possible
+	 */
+	uint32_t below(uint32_t n) {
+		uint64_t m = ((*this)() >> 32) * n;
+		if (uint32_t(m) < n) {
+			uint32_t threshold = uint32_t(-n) % n;
+			while (uint32_t(m) < threshold) m = ((*this)() >> 32) * n;
+		}
+		return uint32_t(m >> 32);
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, unsigned k) { return (x << k) | (x >> (64 - k)); }
+
+	uint64_t s[4];
+};
+
+} // namespace rng
@@ -0,0 +1,375 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+#include "statistic.h"
+#include "parallel.h"
+#include "profile.h"
+
+/**
+ * move selection as a service
+ *
+ * the server loads the network once and answers boards over a Unix domain socket, or over
+ * stdin/stdout, one request per line:
+ *  a board as up to 16 hex digits, cell i being nibble i as in board::raw(), e.g., 21300000000000
+ *   -> the slide take_action would choose (0-3 for up, right, down, left, or -1 if none is legal)
+ *      and the value of each slide ('-' if it is illegal), e.g., "1 1502.5 1733.1 - 1620.7"
+ *  stats -> the average batch and the latencies of the requests since the last stats, e.g.,
+ *      "batch = 3.2, p50 = 4.1 us, p99 = 11.9 us, max = 85 us, n = 120000"
+ * the complete lines of all the clients which are ready in a poll round are answered as a batch:
+ * the afterstates of all their boards are evaluated by one weight_agent::V_batch (or one by one by
+ * player::evaluate if the player searches), and the replies are queued in the outbox of each client,
+ * which is written as the client reads it, so a slow reader never blocks the others
+ * the latency of a request runs from the wake-up of its round to the first write of its reply
+ */
+namespace service {
+
+inline volatile std::sig_atomic_t& stopped() {
+	static volatile std::sig_atomic_t flag = 0;
+	return flag;
+}
+
+inline void write_all(int fd, const char* data, size_t size) {
+	while (size) {
+		ssize_t n = ::write(fd, data, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		data += n, size -= n;
+	}
+}
+
+inline std::string latency(double ns) {
+	char text[32];
+	if (ns < 1e3) std::snprintf(text, sizeof(text), "%.3g ns", ns);
+	else if (ns < 1e6) std::snprintf(text, sizeof(text), "%.3g us", ns / 1e3);
+	else std::snprintf(text, sizeof(text), "%.3g ms", ns / 1e6);
+	return text;
+}
+
+/**
+ * drain a histogram of nanoseconds into "p50 = ..., p99 = ..., max = ..., n = ..."
+ */
+inline std::string percentiles(profile::histogram& h) {
+	std::array<uint64_t, profile::histogram::size> counts = {};
+	uint64_t top = h.drain(counts);
+	return "p50 = " + latency(profile::histogram::quantile(counts, 0.5)) + ", p99 = " + latency(profile::histogram::quantile(counts, 0.99))
+		+ ", max = " + latency(top) + ", n = " + std::to_string(profile::histogram::total(counts));
+}
+
+class server {
+public:
+	server(player& play) : play(play), requests(0), batches(0) {}
+
+	/**
+	 * serve until SIGINT or SIGTERM, on a Unix domain socket, or on stdin/stdout if path is "-"
+	 */
+	void run(const std::string& path) {
+		std::signal(SIGINT, [](int) { stopped() = 1; });
+		std::signal(SIGTERM, [](int) { stopped() = 1; });
+		std::signal(SIGPIPE, SIG_IGN);
+		int listener = -1;
+		if (path == "-") {
+			clients.push_back({ 0, 1, false, {}, {}, 0 }); // stdout stays blocking, it is the only client
+		} else {
+			sockaddr_un addr = {};
+			addr.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("socket path too long: " + path);
+			std::strcpy(addr.sun_path, path.c_str());
+			listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			::unlink(path.c_str());
+			if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listener, 128) != 0)
+				throw std::runtime_error("cannot listen on " + path);
+			std::cerr << "serving on " << path << std::endl;
+		}
+
+		std::vector<pollfd> fds;
+		std::vector<size_t> writers; // the clients polled for POLLOUT, after the ones polled for POLLIN
+		std::vector<char> buffer(1 << 16);
+		while (!stopped() && (listener >= 0 || clients.size())) {
+			fds.clear();
+			writers.clear();
+			for (const peer& c : clients) // a client which does not read its replies is not read either
+				fds.push_back({ c.in, short(c.outbox.size() - c.sent < backlog ? POLLIN : 0), 0 });
+			for (size_t i = 0; i < clients.size(); i++) {
+				if (clients[i].sent == clients[i].outbox.size()) continue;
+				fds.push_back({ clients[i].out, POLLOUT, 0 });
+				writers.push_back(i);
+			}
+			if (listener >= 0) fds.push_back({ listener, POLLIN, 0 });
+			if (::poll(fds.data(), fds.size(), -1) < 0) continue; // interrupted
+			auto wake = std::chrono::steady_clock::now();
+
+			for (size_t k = 0; k < writers.size(); k++)
+				if (fds[clients.size() + k].revents) flush(clients[writers[k]]);
+			round.clear();
+			for (size_t i = 0; i < clients.size(); i++) {
+				if (!fds[i].revents) continue;
+				peer& c = clients[i];
+				ssize_t n = ::read(c.in, buffer.data(), buffer.size());
+				if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+				if (n <= 0) {
+					c.closed = true;
+					continue;
+				}
+				c.inbox.append(buffer.data(), n);
+				size_t begin = 0;
+				for (size_t end; (end = c.inbox.find('\n', begin)) != std::string::npos; begin = end + 1)
+					round.push_back(parse(i, c.inbox.data() + begin, end - begin));
+				c.inbox.erase(0, begin);
+			}
+			if (round.size()) {
+				answer();
+				for (peer& c : clients) if (c.sent < c.outbox.size()) flush(c);
+				auto done = std::chrono::steady_clock::now();
+				uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(done - wake).count();
+				for (size_t k = round.size(); k; k--) latencies.add(ns);
+				requests += round.size();
+				batches += 1;
+			}
+			for (size_t i = clients.size(); i-- > 0; ) {
+				if (!clients[i].closed) continue;
+				if (clients[i].out != 1) ::close(clients[i].out);
+				clients.erase(clients.begin() + i);
+			}
+			if (listener >= 0 && (fds.back().revents & POLLIN)) {
+				int fd = ::accept(listener, nullptr, nullptr);
+				if (fd >= 0) {
+					::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+					clients.push_back({ fd, fd, false, {}, {}, 0 });
+				}
+			}
+		}
+		for (const peer& c : clients) if (c.out != 1) ::close(c.out);
+		if (listener >= 0) {
+			::close(listener);
+			::unlink(path.c_str());
+		}
+		std::cerr << "served " << (total + requests) << " requests" << std::endl;
+	}
+
+private:
+	struct peer {
+		int in, out;
+		bool closed;
+		std::string inbox, outbox;
+		size_t sent; // the bytes of the outbox already written
+	};
+
+	/**
+	 * a request line of a poll round, the legal slides of a board are evaluated in the batch
+	 */
+	struct request {
+		enum { slides, stats, error } kind;
+		size_t client;
+		board::data raw;
+		std::array<board::reward, 4> rewards; // -1 if the slide is illegal
+	};
+
+	request parse(size_t client, const char* line, size_t size) {
+		request r = { request::error, client, 0, {{ -1, -1, -1, -1 }} };
+		if (size == 5 && std::memcmp(line, "stats", 5) == 0) {
+			r.kind = request::stats;
+			return r;
+		}
+		char* end = nullptr;
+		r.raw = size && size <= 16 && std::isxdigit(line[0]) ? std::strtoull(line, &end, 16) : 0;
+		if (end == line + size) r.kind = request::slides;
+		return r;
+	}
+
+	/**
+	 * evaluate the afterstates of all the boards of the round at once, and queue the replies
+	 * in the order of the requests; the choice is the one of player::evaluate
+	 */
+	void answer() {
+		after.clear();
+		for (request& r : round) {
+			if (r.kind != request::slides) continue;
+			for (unsigned op = 0; op < 4; op++) {
+				board b(r.raw);
+				r.rewards[op] = b.slide(op);
+				if (r.rewards[op] != -1) after.push_back(b.raw());
+			}
+		}
+		values.resize(after.size());
+		if (!play.searching()) play.WTF_weight_agent.V_batch(after.data(), after.size(), values.data());
+		const float* value = values.data();
+		for (const request& r : round) {
+			std::string& reply = clients[r.client].outbox;
+			if (r.kind == request::error) {
+				reply += "error: bad request\n";
+				continue;
+			}
+			if (r.kind == request::stats) {
+				char text[64];
+				std::snprintf(text, sizeof(text), "batch = %.3g, ", batches ? double(requests) / batches : 0.0);
+				reply += text + percentiles(latencies) + '\n';
+				total += requests;
+				requests = batches = 0;
+				continue;
+			}
+			std::array<float, 4> slides;
+			unsigned best = 4;
+			if (play.searching()) {
+				best = play.evaluate(board(r.raw), slides);
+			} else {
+				slides.fill(-std::numeric_limits<float>::infinity());
+				for (unsigned op = 0; op < 4; op++) {
+					if (r.rewards[op] == -1) continue;
+					slides[op] = *(value++) + float(r.rewards[op]);
+					if (best == 4 || slides[best] < slides[op]) best = op;
+				}
+			}
+			char text[96];
+			int n = std::snprintf(text, sizeof(text), "%d", best < 4 ? int(best) : -1);
+			for (float v : slides)
+				n += v == -std::numeric_limits<float>::infinity() ? std::snprintf(text + n, sizeof(text) - n, " -") : std::snprintf(text + n, sizeof(text) - n, " %.7g", v);
+			reply.append(text, n).push_back('\n');
+		}
+	}
+
+	/**
+	 * write as much of the outbox as the client takes without blocking
+	 */
+	static void flush(peer& c) {
+		while (c.sent < c.outbox.size()) {
+			ssize_t n = ::write(c.out, c.outbox.data() + c.sent, c.outbox.size() - c.sent);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (n <= 0) {
+				c.closed = true;
+				break;
+			}
+			c.sent += n;
+		}
+		if (c.sent == c.outbox.size() || c.closed) {
+			c.outbox.clear();
+			c.sent = 0;
+		}
+	}
+
+	static const size_t backlog = 1 << 20; // the unwritten bytes above which a client is not read
+
+	player& play;
+	std::vector<peer> clients;
+	std::vector<request> round;
+	std::vector<board::data> after; // the afterstates of the round
+	std::vector<float> values;
+	profile::histogram latencies; // in nanoseconds
+	uint64_t requests, batches, total = 0;
+};
+
+/**
+ * a player whose moves are chosen by a server, one round trip per move
+ */
+class remote : public player {
+public:
+	remote(const std::string& path, profile::histogram& trips) : player("name=remote"), trips(trips), fd(::socket(AF_UNIX, SOCK_STREAM, 0)) {
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+			throw std::runtime_error("cannot connect to " + path);
+	}
+	remote(const remote&) = delete;
+	virtual ~remote() { ::close(fd); }
+
+	virtual action take_action(const board& before) {
+		char line[24];
+		int n = std::snprintf(line, sizeof(line), "%llx\n", (unsigned long long) before.raw());
+		auto start = std::chrono::steady_clock::now();
+		write_all(fd, line, n);
+		size_t end;
+		while ((end = inbox.find('\n')) == std::string::npos) {
+			char buffer[256];
+			ssize_t k = ::read(fd, buffer, sizeof(buffer));
+			if (k <= 0) throw std::runtime_error("connection closed by the server");
+			inbox.append(buffer, k);
+		}
+		trips.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		int op = std::atoi(inbox.c_str());
+		inbox.erase(0, end + 1);
+		if (op < 0 || op > 3) return action();
+		last_opcode = op;
+		return action::slide(op);
+	}
+
+private:
+	profile::histogram& trips;
+	int fd;
+	std::string inbox;
+};
+
+/**
+ * play episodes with the moves chosen by a server over 'threads' connections, e.g., to check
+ * a server against a local run (episode k is the game of seed k, as in worker_pool)
+ */
+class client {
+public:
+	client(const std::string& path, const std::string& evil_args, size_t threads) {
+		for (size_t i = 0; i < std::max(threads, size_t(1)); i++) {
+			plays.emplace_back(new remote(path, trips));
+			evils.emplace_back(new rndenv(evil_args, plays.back().get()));
+		}
+	}
+
+	/**
+	 * play until the statistic is finished
+	 */
+	void run(statistic& stat) {
+		size_t first = stat.episodes(), total = stat.remaining();
+		std::atomic<size_t> next(0);
+		std::mutex lock;
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < plays.size(); i++) {
+			workers.emplace_back([&, i]() {
+				episode game;
+				for (size_t k; (k = next++) < total; ) {
+					worker_pool::play_episode(game, *plays[i], *evils[i], first + k);
+					std::lock_guard<std::mutex> guard(lock);
+					stat.push_episode(game);
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	/**
+	 * print the round trips since the last report, e.g.,
+	 * 	round trip p50 = 9.7 us, p99 = 31 us, max = 1.2 ms, n = 1024000
+	 */
+	void report(std::ostream& out) {
+		out << "\t" << "round trip " << percentiles(trips) << std::endl;
+	}
+
+private:
+	profile::histogram trips; // in nanoseconds
+	std::vector<std::unique_ptr<remote>> plays;
+	std::vector<std::unique_ptr<rndenv>> evils;
+};
+
+} // namespace service
@@ -0,0 +1,259 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+#include "weight.h"
+
+/**
+ * vectorized n-tuple evaluation for networks of 4-tuples and 6-tuples
+ *
+ * a packed board is unpacked to 16 bytes (one cell per byte), then pshufb gathers the
+ * cells of every tuple into its own 32-bit lane, and two multiply-adds fold the cells
+ * into the tuple index, the first cell being the most significant nibble:
+ *  4-tuple lane bytes: [p2, p3, p0, p1] -> (p2*16 + p3) + (p0*16 + p1) * 256
+ *  6-tuple uses two lanes, [p4, p5, p2, p3] as above and [p0, p1, -, -] shifted by 16
+ * the weights are then fetched with gather instructions (the indices of a tracked table are
+ * shifted to its cells) and summed horizontally;
+ * 16-bit tables are gathered as 32-bit words and converted (F16C or scaled int16)
+ *
+ * all kernels are compiled with target attributes and selected at runtime
+ */
+namespace simd {
+
+enum isa { scalar, avx2 };
+
+inline isa detect() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) return avx2;
+	return scalar;
+}
+
+/**
+ * parse the name of an instruction set, the best supported one is used by default
+ */
+inline isa select(const std::string& name = "") {
+	isa best = detect();
+	if (name == "scalar") return scalar;
+	if (name == "avx2" && best >= avx2) return avx2;
+	return best;
+}
+
+inline const char* name(isa set) {
+	switch (set) {
+	case avx2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+/**
+ * pshufb controls of the tuples of a network, in blocks of 32 bytes which are applied on
+ * two 128-bit lanes: a block holds eight 4-tuples, or the low and the high lanes of four 6-tuples
+ * the tuples fit if they are runs of eight 4-tuples and of four 6-tuples, each group of four
+ * tuples which share a table is then gathered at once, and the other groups entry by entry
+ */
+struct shuffle {
+	std::vector<uint8_t> control; // 32 bytes per block
+	std::vector<uint32_t> length; // of the tuples of each block
+	std::vector<int32_t> group; // the table of tuples 4g to 4g+3, or -1 if they do not share one
+
+	shuffle(const std::vector<ntuple>& tuples = {}) {
+		if (!build(tuples)) control.clear(), length.clear(), group.clear();
+	}
+
+	bool fits() const { return length.size(); }
+
+private:
+	bool build(const std::vector<ntuple>& tuples) {
+		for (size_t i = 0; i < tuples.size(); ) {
+			uint32_t length = tuples[i].length, count = length == 4 ? 8 : 4;
+			if ((length != 4 && length != 6) || i + count > tuples.size()) return false;
+			uint8_t block[32];
+			for (uint32_t k = 0; k < count; k++) {
+				const ntuple& t = tuples[i + k];
+				if (t.length != length) return false;
+				uint8_t lane[4] = { uint8_t(t.pos[length - 2]), uint8_t(t.pos[length - 1]), uint8_t(t.pos[length - 4]), uint8_t(t.pos[length - 3]) };
+				std::memcpy(block + k * 4, lane, 4);
+			}
+			for (uint32_t k = 0; length == 6 && k < 4; k++) {
+				const ntuple& t = tuples[i + k];
+				uint8_t high[4] = { uint8_t(t.pos[0]), uint8_t(t.pos[1]), 0x80, 0x80 };
+				std::memcpy(block + 16 + k * 4, high, 4);
+			}
+			control.insert(control.end(), block, block + 32);
+			this->length.push_back(length);
+			i += count;
+		}
+		for (size_t g = 0; g * 4 < tuples.size(); g++) {
+			uint32_t table = tuples[g * 4].table;
+			bool shared = tuples[g * 4 + 1].table == table && tuples[g * 4 + 2].table == table && tuples[g * 4 + 3].table == table;
+			group.push_back(shared ? int32_t(table) : -1);
+		}
+		return true;
+	}
+};
+
+/**
+ * unpack a packed board into 16 bytes, byte i holds cell i
+ */
+__attribute__((target("avx2,f16c")))
+inline __m128i unpack(uint64_t raw) {
+	const uint64_t mask = 0x0f0f0f0f0f0f0f0full;
+	__m128i even = _mm_cvtsi64_si128(raw & mask);
+	__m128i odd = _mm_cvtsi64_si128((raw >> 4) & mask);
+	return _mm_unpacklo_epi8(even, odd);
+}
+
+/**
+ * convert 4 gathered 16-bit entries (the low halves of 32-bit words) to floats
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline __m128 convert(__m128i word, __m128 unit) {
+	if (dtype == weight::float16) {
+		word = _mm_and_si128(word, _mm_set1_epi32(0xffff));
+		return _mm_cvtph_ps(_mm_packus_epi32(word, word));
+	}
+	word = _mm_srai_epi32(_mm_slli_epi32(word, 16), 16);
+	return _mm_mul_ps(_mm_cvtepi32_ps(word), unit);
+}
+
+/**
+ * gather 4 entries of a table as floats
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline __m128 gather(const weight& table, __m128i index) {
+	if (dtype == weight::float32) return _mm_i32gather_ps(table.data(), _mm_sll_epi32(index, _mm_cvtsi32_si128(table.stride())), 4);
+	__m128i word = _mm_i32gather_epi32(static_cast<const int*>(table.raw()), index, 2);
+	return convert<dtype>(word, _mm_set1_ps(table.unit()));
+}
+
+/**
+ * gather an entry of each of 4 tables as floats, by their 64-bit addresses
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline __m128 gather(const weight& t0, const weight& t1, const weight& t2, const weight& t3, __m128i index) {
+	__m256i base = _mm256_set_epi64x(intptr_t(t3.raw()), intptr_t(t2.raw()), intptr_t(t1.raw()), intptr_t(t0.raw()));
+	if (dtype == weight::float32) {
+		__m256i shift = _mm256_set_epi64x(t3.stride() + 2, t2.stride() + 2, t1.stride() + 2, t0.stride() + 2);
+		__m256i addr = _mm256_add_epi64(base, _mm256_sllv_epi64(_mm256_cvtepu32_epi64(index), shift));
+		return _mm256_i64gather_ps(static_cast<const float*>(nullptr), addr, 1);
+	}
+	__m256i addr = _mm256_add_epi64(base, _mm256_slli_epi64(_mm256_cvtepu32_epi64(index), 1));
+	__m128i word = _mm256_i64gather_epi32(static_cast<const int*>(nullptr), addr, 1);
+	return convert<dtype>(word, _mm_set_ps(t3.unit(), t2.unit(), t1.unit(), t0.unit()));
+}
+
+/**
+ * the entries of the g-th group of four tuples, at once from their table if they share one
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline __m128 gather(const shuffle& ctl, const std::vector<weight>& net, const std::vector<ntuple>& tuples, size_t g, __m128i index) {
+	if (ctl.group[g] >= 0) return gather<dtype>(net[ctl.group[g]], index);
+	const ntuple* t = &tuples[g * 4];
+	return gather<dtype>(net[t[0].table], net[t[1].table], net[t[2].table], net[t[3].table], index);
+}
+
+/**
+ * the tuple indices of the b-th block, 8 lanes of 4-tuples or 4 lanes of 6-tuples
+ */
+__attribute__((target("avx2,f16c")))
+inline __m256i indices_block(__m256i cells, const shuffle& ctl, size_t b) {
+	const __m256i nibble = _mm256_set1_epi16(0x0110); // bytes (16, 1)
+	const __m256i byte = _mm256_set1_epi32(0x01000001); // words (1, 256)
+	__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&ctl.control[b * 32]));
+	__m256i f = _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_shuffle_epi8(cells, c), nibble), byte);
+	if (ctl.length[b] == 4) return f;
+	return _mm256_castsi128_si256(_mm_add_epi32(_mm256_castsi256_si128(f), _mm_slli_epi32(_mm256_extracti128_si256(f, 1), 16)));
+}
+
+/**
+ * the sum of the entries of a board, the indices are also written to 'index' if it is given
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline float evaluate_avx2(uint64_t raw, const shuffle& ctl, const std::vector<weight>& net, const std::vector<ntuple>& tuples, uint32_t* index) {
+	__m256i cells = _mm256_broadcastsi128_si256(unpack(raw));
+	__m128 sum = _mm_setzero_ps();
+	for (size_t b = 0, g = 0; b < ctl.length.size(); b++) {
+		__m256i f = indices_block(cells, ctl, b);
+		sum = _mm_add_ps(sum, gather<dtype>(ctl, net, tuples, g++, _mm256_castsi256_si128(f)));
+		if (ctl.length[b] == 4) {
+			sum = _mm_add_ps(sum, gather<dtype>(ctl, net, tuples, g++, _mm256_extracti128_si256(f, 1)));
+			if (index) _mm256_storeu_si256(reinterpret_cast<__m256i*>(index), f), index += 8;
+		} else {
+			if (index) _mm_storeu_si128(reinterpret_cast<__m128i*>(index), _mm256_castsi256_si128(f)), index += 4;
+		}
+	}
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+	return _mm_cvtss_f32(sum);
+}
+
+/**
+ * the indices of a board, in the order of the tuples, as extract does
+ */
+__attribute__((target("avx2,f16c")))
+inline void indices_avx2(uint64_t raw, const shuffle& ctl, uint32_t* index) {
+	__m256i cells = _mm256_broadcastsi128_si256(unpack(raw));
+	for (size_t b = 0; b < ctl.length.size(); b++) {
+		__m256i f = indices_block(cells, ctl, b);
+		if (ctl.length[b] == 4) _mm256_storeu_si256(reinterpret_cast<__m256i*>(index), f), index += 8;
+		else _mm_storeu_si128(reinterpret_cast<__m128i*>(index), _mm256_castsi256_si128(f)), index += 4;
+	}
+}
+
+/**
+ * the sum of the entries of the indices of a board
+ */
+template<weight::type dtype>
+__attribute__((target("avx2,f16c")))
+inline float sum_avx2(const shuffle& ctl, const std::vector<weight>& net, const std::vector<ntuple>& tuples, const uint32_t* index) {
+	__m128 sum = _mm_setzero_ps();
+	for (size_t g = 0; g < ctl.group.size(); g++)
+		sum = _mm_add_ps(sum, gather<dtype>(ctl, net, tuples, g, _mm_loadu_si128(reinterpret_cast<const __m128i*>(index + g * 4))));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+	return _mm_cvtss_f32(sum);
+}
+
+/**
+ * patch w tuple indices by 'changed', the xor of two packed boards, as weight_agent::update does:
+ * row p of scale (w words) holds the bit of cell p in the index of each tuple, so a changed cell
+ * of nibble d xors d * scale[p][t] into index t; eight tuples are patched at once, and each block
+ * of them is kept in a register while all the changed cells are applied
+ */
+__attribute__((target("avx2,f16c")))
+inline void update_avx2(uint64_t changed, const uint32_t* scale, size_t w, uint32_t* index) {
+	const uint32_t* row[16];
+	uint32_t nibble[16];
+	unsigned n = 0;
+	for (; changed; n++) {
+		unsigned p = __builtin_ctzll(changed) >> 2;
+		nibble[n] = uint32_t(changed >> (p << 2)) & 0x0f;
+		row[n] = scale + p * w;
+		changed &= ~(uint64_t(0x0f) << (p << 2));
+	}
+	size_t t = 0;
+	for (; t + 8 <= w; t += 8) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index + t));
+		for (unsigned k = 0; k < n; k++)
+			x = _mm256_xor_si256(x, _mm256_mullo_epi32(_mm256_set1_epi32(nibble[k]), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row[k] + t))));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(index + t), x);
+	}
+	for (; t + 4 <= w; t += 4) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(index + t));
+		for (unsigned k = 0; k < n; k++)
+			x = _mm_xor_si128(x, _mm_mullo_epi32(_mm_set1_epi32(nibble[k]), _mm_loadu_si128(reinterpret_cast<const __m128i*>(row[k] + t))));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(index + t), x);
+	}
+	for (; t < w; t++)
+		for (unsigned k = 0; k < n; k++) index[t] ^= nibble[k] * row[k][t];
+}
+
+} // namespace simd
@@ -1,13 +1,21 @@
 #pragma once
-#include <list>
+#include <array>
+#include <memory>
+#include <stdexcept>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <vector>
+#include <functional>
+#include <cmath>
+#include <fstream>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
+#include "archive.h"
+#include "rng.h"
 
 class statistic {
 public:
@@ -22,7 +30,7 @@ public:
 		: total(total),
 		  block(block ? block : total),
 		  limit(limit ? limit : total),
-		  count(0) {}
+		  count(0), head(0), held(0), quantiles(false) {}
 
 public:
 	/**
@@ -47,113 +55,474 @@ public:
 	 *  '93.7%': 93.7% (937 games) reached 8192-tiles (a.k.a. win rate of 8192-tile)
 	 *  '22.4%': 22.4% (224 games) terminated with 8192-tiles (the largest)
 	 */
-	void show(bool tstat = true) const {
-		size_t blk = std::min(data.size(), block);
-		std::map<uint32_t,int> stat;
-        //size_t stat[64] = { 0 };
-		size_t sop = 0, pop = 0, eop = 0;
-		time_t sdu = 0, pdu = 0, edu = 0;
-		board::reward sum = 0, max = 0;
-		auto it = data.end();
-		for (size_t i = 0; i < blk; i++) {
-			auto& ep = *(--it);
+	void show(bool tstat = true) {
+		show(recent, tstat);
+		recent = {};
+	}
+
+	/**
+	 * show the statistic of all games, with the digest of their moves below the first line, e.g.,
+	 * 	digest = 5c1e0f27a9d3b864 (1000 episodes)
+	 * which is the same for any order of the same games, so two runs of the same seeds and weights
+	 * (e.g., with --threads=1 and --threads=8 and alpha=0) must print the same digest
+	 * the attached reports are not printed, as they cover the last block only
+	 */
+	void summary() const {
+		show(overall, true, true);
+	}
+
+	/**
+	 * stream the statistic, only the episode in progress is held and the finished ones
+	 * are written to 'path' (if given) as they close, so memory stays constant for any total
+	 */
+	void stream(const std::string& path = "") {
+		limit = 1;
+		if (held > 1) {
+			std::swap(data[0], back());
+			data.resize(1);
+			head = 0;
+			held = 1;
+		}
+		if (path.empty()) return;
+		if (binary(path)) {
+			std::shared_ptr<archive::writer> out = std::make_shared<archive::writer>(path);
+			sink = [out](const episode* ep) { ep ? out->write(*ep) : out->close(); };
+		} else {
+			std::shared_ptr<std::ofstream> out = std::make_shared<std::ofstream>(path, std::ios::out | std::ios::trunc);
+			sink = [out](const episode* ep) { ep ? (*out << *ep << std::endl) : out->flush(); };
+		}
+	}
+
+	/**
+	 * finish the stream of episodes, if any
+	 */
+	void flush() {
+		if (sink) sink(nullptr);
+		sink = nullptr;
+	}
+
+	/**
+	 * print the score percentiles below the first line of each summary
+	 */
+	void percentiles(bool show = true) {
+		quantiles = show;
+	}
+
+	/**
+	 * merge the summary of another run (e.g., another process or thread), which is exact
+	 * as the summaries hold only sums, maxima and fixed-bucket histograms
+	 */
+	void merge(const statistic& other) {
+		overall.merge(other.overall);
+		count += other.count;
+		total = std::max(total, count);
+	}
+
+	/**
+	 * save or load the summary alone, so that runs can be merged later
+	 */
+	void save_summary(const std::string& path) const {
+		std::ofstream out(path, std::ios::out | std::ios::trunc);
+		out << count << ' ' << overall << std::endl;
+	}
+	void load_summary(const std::string& path) {
+		statistic other(0);
+		std::ifstream in(path, std::ios::in);
+		if (!(in >> other.count >> other.overall)) throw std::runtime_error("cannot read summary " + path);
+		merge(other);
+	}
+
+	/**
+	 * compare the last records with those of a baseline played on the same seeds
+	 *
+	 * the format would be
+	 * compare	avg = 5054 (5034, +0.4%), same score = 297/300
+	 * 	48	72%	(72.3%)	-0.3%
+	 * 	96	19.7%	(19.3%)	+0.3%
+	 *
+	 * where the numbers in parentheses belong to the baseline, and the last column
+	 * is the difference of the win rates
+	 */
+	void compare(const statistic& base) const {
+		size_t blk = std::min(held, base.held);
+		if (blk == 0) return;
+		std::map<uint32_t, size_t> ours, theirs;
+		board::reward sum = 0, bsum = 0;
+		size_t same = 0;
+		for (size_t i = 1; i <= blk; i++) {
+			const episode& ep = at(held - i);
+			const episode& bp = base.at(base.held - i);
 			sum += ep.score();
-			max = std::max(ep.score(), max);
-            uint32_t max_tile=*std::max_element(&(ep.state()(0)), &(ep.state()(16)));
-            auto stat_iter = stat.find(max_tile);
-			if(stat_iter==stat.end()){
-                stat.insert(std::pair<uint32_t,int>(max_tile,1));
-            }
-            else{
-                stat_iter->second++;
-            }
-            //stat[*std::max_element(&(ep.state()(0)), &(ep.state()(16)))]++;
-			sop += ep.step();
-			pop += ep.step(action::slide::type);
-			eop += ep.step(action::place::type);
-			sdu += ep.time();
-			pdu += ep.time(action::slide::type);
-			edu += ep.time(action::place::type);
+			bsum += bp.score();
+			same += ep.score() == bp.score();
+			ours[ep.state().max_tile()]++;
+			theirs[bp.state().max_tile()]++;
+			ours.insert({ bp.state().max_tile(), 0 });
+			theirs.insert({ ep.state().max_tile(), 0 });
 		}
 
 		std::ios ff(nullptr);
 		ff.copyfmt(std::cout);
+		std::cout << "compare\t";
 		std::cout << std::fixed << std::setprecision(0);
-		std::cout << count << "\t";
-		std::cout << "avg = " << (sum / blk) << ", ";
-		std::cout << "max = " << (max) << ", ";
-		std::cout << "ops = " << (sop * 1000.0 / sdu);
-		std::cout <<     " (" << (pop * 1000.0 / pdu);
-		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
+		std::cout << "avg = " << (sum / blk) << " (" << (bsum / blk) << ", ";
+		std::cout << std::showpos << std::setprecision(1) << ((sum - bsum) * 100.0 / std::max(bsum, board::reward(1))) << "%)";
+		std::cout << std::noshowpos << ", same score = " << same << "/" << blk;
 		std::cout << std::endl;
 		std::cout.copyfmt(ff);
-
-		if (!tstat) return;
-        int accu=0;
-		for (auto sit=stat.begin(); sit!=stat.end(); sit++) {
-			if (sit->second == 0) continue;
-			//unsigned accu = std::accumulate(std::begin(stat) + t, std::end(stat), 0);
-			accu=accu+sit->second;
-            std::cout << "\t" << tile_decode_table[sit->first]; // type
-			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
-			std::cout << "\t" "(" << (sit->second * 100.0 / blk) << "%" ")"; // percentage of ending
+		size_t accu = blk, baccu = blk;
+		for (auto sit = ours.begin(); sit != ours.end(); sit++) {
+			double rate = accu * 100.0 / blk, brate = baccu * 100.0 / blk;
+			std::cout << "\t" << tile_decode_table[sit->first];
+			std::cout << "\t" << rate << "%";
+			std::cout << "\t" "(" << brate << "%" ")";
+			std::cout << "\t" << std::showpos << (rate - brate) << "%" << std::noshowpos;
 			std::cout << std::endl;
+			accu -= sit->second;
+			baccu -= theirs[sit->first];
 		}
 		std::cout << std::endl;
 	}
 
-	void summary() const {
-		auto block_temp = block;
-		const_cast<statistic&>(*this).block = data.size();
-		show();
-		const_cast<statistic&>(*this).block = block_temp;
+	/**
+	 * print no block summaries, e.g., for a baseline which only compare() prints
+	 */
+	void mute() {
+		block = 0;
+	}
+
+	/**
+	 * attach an extra report printed below the first line of each block summary, which reports
+	 * (and may reset) its counters since the last block
+	 */
+	void attach(std::function<void(std::ostream&)> report) {
+		reports.push_back(report);
 	}
 
 	bool is_finished() const {
 		return count >= total;
 	}
 
+	size_t episodes() const {
+		return count;
+	}
+
+	/**
+	 * the moves of all the finished episodes
+	 */
+	size_t moves() const {
+		return overall.sop;
+	}
+
+	size_t remaining() const {
+		return is_finished() ? 0 : total - count;
+	}
+
 	void open_episode(const std::string& flag = "") {
-		if (count++ >= limit) data.pop_front();
-		data.emplace_back();
-		data.back().open_episode(flag);
+		profile::scope timer(profile::bookkeeping);
+		count++;
+		slot().open_episode(flag);
 	}
 
 	void close_episode(const std::string& flag = "") {
-		data.back().close_episode(flag);
-		if (count % block == 0) show();
+		profile::scope timer(profile::bookkeeping);
+		back().close_episode(flag);
+		finish(back());
+	}
+
+	/**
+	 * record an episode which has been played elsewhere (e.g., by a worker thread)
+	 * the episode is swapped with a recycled one, so its storage can be reused by the caller
+	 */
+	void push_episode(episode& ep) {
+		profile::scope timer(profile::bookkeeping);
+		count++;
+		std::swap(slot(), ep);
+		finish(back());
+	}
+	void push_episode(episode&& ep) {
+		push_episode(ep);
 	}
 
 	episode& at(size_t i) {
-		auto it = data.begin();
-		while (i--) it++;
-		return *it;
+		return data[(head + i) % data.size()];
+	}
+	const episode& at(size_t i) const {
+		return data[(head + i) % data.size()];
 	}
 	episode& front() {
-		return data.front();
+		return at(0);
 	}
 	episode& back() {
-		return data.back();
+		return at(held - 1);
 	}
 
 	friend std::ostream& operator <<(std::ostream& out, const statistic& stat) {
-		for (const episode& rec : stat.data) out << rec << std::endl;
+		for (size_t i = 0; i < stat.held; i++) out << stat.at(i) << std::endl;
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, statistic& stat) {
+		episode ep;
 		for (std::string line; std::getline(in, line) && line.size(); ) {
-			stat.data.emplace_back();
-			std::stringstream(line) >> stat.data.back();
+			std::stringstream(line) >> ep;
+			stat.record(ep);
 		}
-		stat.total = std::max(stat.total, stat.data.size());
-		stat.count = stat.data.size();
+		stat.total = std::max(stat.total, stat.count);
 		return in;
 	}
 
+	/**
+	 * load the episodes of a text or binary log, which is streamed so that only the last
+	 * 'limit' episodes are held while the summary covers all of them
+	 */
+	void load(const std::string& path) {
+		scan(path, [this](const episode& ep) { record(ep); });
+		total = std::max(total, count);
+	}
+
+	/**
+	 * save the held episodes, in the binary format if the path ends with ".bin"
+	 */
+	void save(const std::string& path) const {
+		if (binary(path)) {
+			archive::writer out(path);
+			for (size_t i = 0; i < held; i++) out.write(at(i));
+			out.close();
+		} else {
+			std::ofstream out(path, std::ios::out | std::ios::trunc);
+			out << *this;
+		}
+	}
+
+	/**
+	 * convert a log between the text and binary formats, one episode at a time
+	 */
+	static void convert(const std::string& from, const std::string& to) {
+		if (binary(to)) {
+			archive::writer out(to);
+			scan(from, [&](const episode& ep) { out.write(ep); });
+			out.close();
+		} else {
+			std::ofstream out(to, std::ios::out | std::ios::trunc);
+			scan(from, [&](const episode& ep) { out << ep << std::endl; });
+		}
+	}
+
+	/**
+	 * visit the episodes of a text or binary log in order
+	 */
+	static void scan(const std::string& path, const std::function<void(const episode&)>& visit) {
+		episode ep;
+		if (archive::is(path)) {
+			archive::reader in(path);
+			while (in.next(ep)) visit(ep);
+			return;
+		}
+		std::ifstream in(path, std::ios::in);
+		for (std::string line; std::getline(in, line) && line.size(); ) {
+			std::stringstream(line) >> ep;
+			visit(ep);
+		}
+	}
+
+	static bool binary(const std::string& path) {
+		return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+	}
+
+private:
+	/**
+	 * log-linear histogram of scores, exact below 32 and 32 buckets per power of two above
+	 * (relative error < 1.6% at the bucket midpoint); the boundaries are fixed so merging is exact
+	 */
+	struct sketch {
+		std::array<uint64_t, 28 * 32> counts;
+		sketch() { counts.fill(0); }
+
+		static size_t bucket(uint32_t v) {
+			if (v < 32) return v;
+			unsigned e = 31 - __builtin_clz(v);
+			return (e - 4) * 32 + ((v >> (e - 5)) & 31);
+		}
+		static uint32_t midpoint(size_t b) {
+			if (b < 32) return b;
+			unsigned e = b / 32 + 4;
+			return ((32 + (b % 32)) << (e - 5)) + ((1u << (e - 5)) >> 1);
+		}
+
+		void add(board::reward score) { counts[bucket(std::max(score, 0))]++; }
+		void merge(const sketch& s) { for (size_t i = 0; i < counts.size(); i++) counts[i] += s.counts[i]; }
+
+		/**
+		 * the score at quantile q of n scores
+		 */
+		uint32_t quantile(double q, uint64_t n) const {
+			uint64_t rank = std::max(uint64_t(std::ceil(q * n)), uint64_t(1)), accu = 0;
+			for (size_t i = 0; i < counts.size(); i++)
+				if ((accu += counts[i]) >= rank) return midpoint(i);
+			return 0;
+		}
+	};
+
+	/**
+	 * the aggregates of a set of episodes, which is all that a summary needs
+	 */
+	struct tally {
+		size_t count;
+		size_t sop, pop, eop;
+		time_t sdu, pdu, edu;
+		int64_t sum;
+		board::reward max;
+		std::array<size_t, 16> tiles;
+		sketch scores;
+		uint64_t digest; // the sum of the hashes of the moves of the episodes, which does not depend on their order
+		tally() : count(0), sop(0), pop(0), eop(0), sdu(0), pdu(0), edu(0), sum(0), max(0), digest(0) { tiles.fill(0); }
+
+		void add(const episode& ep) {
+			count++;
+			uint64_t h = ep.ep_moves.size();
+			for (const episode::move& mv : ep.ep_moves) h = rng::mix(h ^ archive::encode(mv.code));
+			digest += rng::mix(h);
+			sum += ep.score();
+			max = std::max(ep.score(), max);
+			tiles[ep.state().max_tile()]++;
+			scores.add(ep.score());
+			sop += ep.step();
+			pop += ep.step(action::slide::type);
+			eop += ep.step(action::place::type);
+			sdu += ep.time();
+			pdu += ep.time(action::slide::type);
+			edu += ep.time(action::place::type);
+		}
+
+		void merge(const tally& t) {
+			count += t.count;
+			sum += t.sum;
+			max = std::max(t.max, max);
+			for (size_t i = 0; i < tiles.size(); i++) tiles[i] += t.tiles[i];
+			scores.merge(t.scores);
+			sop += t.sop, pop += t.pop, eop += t.eop;
+			sdu += t.sdu, pdu += t.pdu, edu += t.edu;
+			digest += t.digest;
+		}
+
+		friend std::ostream& operator <<(std::ostream& out, const tally& t) {
+			out << t.count << ' ' << t.sum << ' ' << t.max;
+			out << ' ' << t.sop << ' ' << t.pop << ' ' << t.eop << ' ' << t.sdu << ' ' << t.pdu << ' ' << t.edu;
+			for (size_t n : t.tiles) out << ' ' << n;
+			for (size_t i = 0; i < t.scores.counts.size(); i++) // sparse, as (bucket, count) pairs
+				if (t.scores.counts[i]) out << ' ' << i << ':' << t.scores.counts[i];
+			out << ' ' << std::hex << "digest:" << t.digest << std::dec;
+			return out;
+		}
+		friend std::istream& operator >>(std::istream& in, tally& t) {
+			in >> t.count >> t.sum >> t.max >> t.sop >> t.pop >> t.eop >> t.sdu >> t.pdu >> t.edu;
+			for (size_t& n : t.tiles) in >> n;
+			std::string line;
+			std::getline(in, line);
+			std::stringstream pairs(line);
+			t.digest = 0; // a summary saved without one
+			for (std::string pair; pairs >> pair; ) {
+				size_t colon = pair.find(':');
+				if (colon == std::string::npos) continue;
+				if (pair.compare(0, colon, "digest") == 0) {
+					t.digest = std::stoull(pair.substr(colon + 1), nullptr, 16);
+					continue;
+				}
+				size_t i = std::stoull(pair.substr(0, colon));
+				if (i < t.scores.counts.size()) t.scores.counts[i] = std::stoull(pair.substr(colon + 1));
+			}
+			return in;
+		}
+	};
+
+	/**
+	 * operations per second, or 0 if no time was taken (e.g., loaded from a log without times)
+	 */
+	static double rate(size_t ops, time_t duration) {
+		return duration ? ops * 1000000.0 / duration : 0;
+	}
+
+	void show(const tally& t, bool tstat = true, bool whole = false) const {
+		size_t blk = std::max(t.count, size_t(1));
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << count << "\t";
+		std::cout << "avg = " << (t.sum / blk) << ", ";
+		std::cout << "max = " << (t.max) << ", ";
+		std::cout << "ops = " << rate(t.sop, t.sdu);
+		std::cout <<     " (" << rate(t.pop, t.pdu);
+		std::cout <<      "|" << rate(t.eop, t.edu) << ")";
+		std::cout << std::endl;
+		if (quantiles) {
+			std::cout << "\tscore p10 = " << t.scores.quantile(0.1, t.count) << ", p50 = " << t.scores.quantile(0.5, t.count);
+			std::cout << ", p90 = " << t.scores.quantile(0.9, t.count) << ", p99 = " << t.scores.quantile(0.99, t.count);
+			std::cout << std::endl;
+		}
+		if (whole) {
+			std::cout << "\tdigest = " << std::hex << std::setw(16) << std::setfill('0') << t.digest << std::dec << std::setfill(' ');
+			std::cout << " (" << t.count << " episodes)" << std::endl;
+		}
+		std::cout.copyfmt(ff);
+		if (!whole) for (auto& report : reports) report(std::cout);
+
+		if (!tstat) return;
+		size_t accu = 0;
+		for (uint32_t tile = 0; tile < t.tiles.size(); tile++) {
+			if (t.tiles[tile] == 0) continue;
+			accu = accu + t.tiles[tile];
+			std::cout << "\t" << tile_decode_table[tile]; // type
+			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
+			std::cout << "\t" "(" << (t.tiles[tile] * 100.0 / blk) << "%" ")"; // percentage of ending
+			std::cout << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	/**
+	 * account a finished episode
+	 */
+	void finish(const episode& ep) {
+		recent.add(ep);
+		overall.add(ep);
+		if (sink) sink(&ep);
+		if (block && count % block == 0) show();
+	}
+
+	/**
+	 * keep a loaded episode, only the last 'limit' ones (at least one) are held
+	 */
+	void record(const episode& ep) {
+		slot() = ep;
+		overall.add(ep);
+		count++;
+	}
+
+	/**
+	 * the slot for a new episode, the oldest one is recycled (with its move storage)
+	 * once 'limit' episodes (at least one) are held, so no allocation is needed after that
+	 */
+	episode& slot() {
+		if (held < std::max(limit, size_t(1))) {
+			if (head + held == data.size()) data.emplace_back();
+			held++;
+		} else {
+			head = (head + 1) % data.size();
+		}
+		return back();
+	}
+
 private:
 	size_t total;
-	size_t block;
+	size_t block; // 0 if muted
 	size_t limit;
 	size_t count;
-	std::list<episode> data;
+	std::vector<episode> data; // a ring of the last 'held' episodes, starting at 'head'
+	size_t head;
+	size_t held;
+	tally recent; // of the episodes since the last show()
+	tally overall; // of all the recorded episodes
+	bool quantiles;
+	std::function<void(const episode*)> sink; // the stream of finished episodes, nullptr to close
+	std::vector<std::function<void(std::ostream&)>> reports;
 };
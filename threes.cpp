@@ -10,21 +10,36 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <sstream>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistic.h"
+#include "parallel.h"
+#include "allocation.h"
+#include "perf.h"
+#include "service.h"
+#include <cstdlib>
+#include <new>
+
+/**
+ * count every heap allocation for --allocs (kept out of line, so GCC does not pair malloc with delete)
+ */
+__attribute__((noinline)) void* operator new(std::size_t size) {
+	allocation::counter().fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+	std::free(p);
+}
 
 int main(int argc, const char* argv[]) {
-	std::cout << "threes-Demo: ";
-	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
-	std::cout << std::endl << std::endl;
-
-	size_t total = 1000, block = 0, limit = 0;
-	std::string play_args, evil_args;
-	std::string load, save;
-	bool summary = false;
+	size_t total = 1000, block = 0, limit = 0, threads = 1;
+	std::string play_args, evil_args, compare_args;
+	std::string load, save, tally, merge, serve, client;
+	bool summary = false, convert = false, stream = false, quantile = false, allocs = false, latency = false, counters = false;
     bool vb=false;
 	for (int i = 1; i < argc; i++) {
 		std::string para(argv[i]);
@@ -34,14 +49,38 @@ int main(int argc, const char* argv[]) {
 			block = std::stoull(para.substr(para.find("=") + 1));
 		} else if (para.find("--limit=") == 0) {
 			limit = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--threads=") == 0) {
+			threads = std::stoull(para.substr(para.find("=") + 1));
 		} else if (para.find("--play=") == 0) {
 			play_args = para.substr(para.find("=") + 1);
 		} else if (para.find("--evil=") == 0) {
 			evil_args = para.substr(para.find("=") + 1);
+		} else if (para.find("--compare=") == 0) {
+			compare_args = para.substr(para.find("=") + 1);
 		} else if (para.find("--load=") == 0) {
 			load = para.substr(para.find("=") + 1);
 		} else if (para.find("--save=") == 0) {
 			save = para.substr(para.find("=") + 1);
+		} else if (para.find("--tally=") == 0) {
+			tally = para.substr(para.find("=") + 1);
+		} else if (para.find("--merge=") == 0) {
+			merge = para.substr(para.find("=") + 1);
+		} else if (para.find("--serve=") == 0) {
+			serve = para.substr(para.find("=") + 1);
+		} else if (para.find("--client=") == 0) {
+			client = para.substr(para.find("=") + 1);
+		} else if (para.find("--stream") == 0) {
+			stream = true;
+		} else if (para.find("--profile") == 0) {
+			latency = true;
+		} else if (para.find("--perf") == 0) {
+			counters = true;
+		} else if (para.find("--allocs") == 0) {
+			allocs = true;
+		} else if (para.find("--quantile") == 0) {
+			quantile = true;
+		} else if (para.find("--convert") == 0) {
+			convert = true;
 		} else if (para.find("--summary") == 0) {
 			summary = true;
 		} else if (para.find("-v") == 0) {
@@ -49,24 +88,96 @@ int main(int argc, const char* argv[]) {
 		}
 	}
 
+	if (serve != "-") { // stdout carries the replies when serving on stdin
+		std::cout << "threes-Demo: ";
+		std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
+		std::cout << std::endl << std::endl;
+	}
+
+	if (convert) { // rewrite --load into --save, between the text and binary formats
+		statistic::convert(load, save);
+		return 0;
+	}
+
+	if (limit == 0 && save.empty() && compare_args.empty()) // only --save and --compare read finished episodes, the summaries keep tallies
+		limit = 1; // so memory stays constant for any total
 	statistic stat(total, block, limit);
+	stat.percentiles(quantile);
 
 	if (load.size()) {
-		std::ifstream in(load, std::ios::in);
-		in >> stat;
-		in.close();
+		stat.load(load);
 		summary |= stat.is_finished();
 	}
 
+	for (std::stringstream paths(merge); std::getline(paths, merge, ','); ) { // merge the summaries of other runs
+		stat.load_summary(merge);
+		summary = true;
+	}
+
+	if (stream) { // hold no finished episodes, write them to --save as they close
+		stat.stream(save);
+		save.clear();
+	}
+
     //agent
 	player play(play_args);
 	rndenv evil(evil_args,&play);
+	if (serve.size()) { // answer boards until interrupted, see service.h for the protocol
+		service::server(play).run(serve);
+		return 0;
+	}
+	if (play.searching()) stat.attach([&](std::ostream& out) { play.report(out); });
+	if (play.WTF_weight_agent.checkpointing()) stat.attach([&](std::ostream& out) { play.WTF_weight_agent.report(out); });
+	if (latency) { // print p50/p99/max latencies of the phases of each block
+		profile::enabled() = true;
+		stat.attach(profile::report);
+	}
+	if (allocs) { // print the heap allocations per episode since the last block
+		uint64_t last_allocs = allocation::count(), last_episodes = stat.episodes();
+		stat.attach([&stat, last_allocs, last_episodes](std::ostream& out) mutable {
+			uint64_t n = allocation::count() - last_allocs, k = stat.episodes() - last_episodes;
+			out << "\t" << "alloc = " << (k ? n / double(k) : 0) << "/episode (" << n << " in " << k << " episodes)" << std::endl;
+			last_allocs += n, last_episodes += k;
+		});
+	}
+
+	std::unique_ptr<perf::counters> hw;
+	if (counters) { // print the hardware counters of each block, in total and per move
+		hw.reset(new perf::counters());
+		if (hw->available()) {
+			uint64_t last_moves = stat.moves();
+			stat.attach([&stat, &hw, last_moves](std::ostream& out) mutable {
+				uint64_t n = stat.moves() - last_moves;
+				hw->report(out, n);
+				last_moves += n;
+			});
+		} else {
+			std::cerr << "perf counters unavailable (" << hw->error << ")" << std::endl;
+		}
+	}
+
+	std::unique_ptr<service::client> remote; // outlives the run, whose block summaries report it
+	if (client.size()) { // play with the moves of a server over --threads connections
+		remote.reset(new service::client(client, evil_args, threads));
+		stat.attach([&](std::ostream& out) { remote->report(out); });
+		remote->run(stat);
+	} else if (threads > 1) {
+		if (play.WTF_learning_agent.get_alpha() == 0) // read-only weights
+			evaluation(play, evil_args, threads).run(stat);
+		else
+			selfplay(play, evil_args, threads).run(stat);
+	}
 
+	// the tags are built once, so that an episode allocates nothing once the statistic recycles them
+	const std::string play_tag = "~:" + evil.name(), evil_tag = play.name() + ":~";
+	const std::string game_tag = play.name() + ":" + evil.name();
+	const std::string play_name = play.name(), evil_name = evil.name();
 	while (!stat.is_finished()) {
-		play.open_episode("~:" + evil.name());
-		evil.open_episode(play.name() + ":~");
+		evil.fork(stat.episodes());
+		play.open_episode(play_tag);
+		evil.open_episode(evil_tag);
 
-		stat.open_episode(play.name() + ":" + evil.name());
+		stat.open_episode(game_tag);
 		episode& game = stat.back();
         int i=0;
 		while (true) {
@@ -93,10 +204,11 @@ int main(int argc, const char* argv[]) {
 		}
         if(vb)std::cout<<game.state()<<std::endl;
 		agent& win = game.last_turns(play, evil);
-		stat.close_episode(win.name());
+		const std::string& win_name = (&win == &play) ? play_name : evil_name;
+		stat.close_episode(win_name);
 
-		play.close_episode(win.name());
-		evil.close_episode(win.name());
+		play.close_episode(win_name);
+		evil.close_episode(win_name);
 	}
     if(vb)std::cout<<play.WTF_weight_agent<<std::endl;
 
@@ -104,10 +216,27 @@ int main(int argc, const char* argv[]) {
 		stat.summary();
 	}
 
+	if (compare_args.size()) { // replay the same seeds with a baseline player
+		statistic base(total, total, limit);
+		base.mute();
+		player ref(compare_args);
+		rndenv env(evil_args, &ref);
+		for (size_t k = 0; !base.is_finished(); k++) {
+			episode game;
+			worker_pool::play_episode(game, ref, env, k);
+			base.push_episode(std::move(game));
+		}
+		stat.compare(base);
+	}
+
+	stat.flush();
+
 	if (save.size()) {
-		std::ofstream out(save, std::ios::out | std::ios::trunc);
-		out << stat;
-		out.close();
+		stat.save(save);
+	}
+
+	if (tally.size()) {
+		stat.save_summary(tally);
 	}
 
 	return 0;
@@ -0,0 +1,136 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "board.h"
+
+/**
+ * lock-free transposition table for afterstate values
+ *
+ * an afterstate is keyed by its board and the opcode which produced it (the opcode
+ * decides where the next tile spawns); both are canonicalized under the first 'sym'
+ * symmetries of board::Flip_board, i.e., 4 for rotations only and 8 for all isomorphisms
+ *
+ * each entry holds (key ^ data, data), so an entry torn by a concurrent store fails
+ * the check and reads as a miss (lockless hashing), no lock is needed between threads
+ * a bucket has two entries: the first keeps the deeper result unless it comes from an
+ * older generation, the second is always replaced
+ *
+ * the values depend on the weights, so the generation is advanced whenever the weights are
+ * updated, and an entry of an older generation is never returned
+ */
+class transposition {
+public:
+	/**
+	 * create a table with 2^bits entries
+	 */
+	transposition(unsigned bits = 20, unsigned sym = 8)
+		: shift(64 - (std::max(bits, 2u) - 1)), sym(std::min(std::max(sym, 1u), 8u)), age(0), table(size_t(1) << (std::max(bits, 2u) - 1)) {}
+
+public:
+	/**
+	 * look up the value of an afterstate searched with at least the given depth by the current generation
+	 */
+	bool probe(const board& after, unsigned op, unsigned depth, float& value) const {
+		board::data key;
+		canonicalize(after, op, key);
+		const bucket& b = table[index(key, op)];
+		unsigned gen = age.load(std::memory_order_relaxed) & 0xffff;
+		for (const entry& e : b.slot) {
+			uint64_t data = e.data.load(std::memory_order_relaxed);
+			uint64_t check = e.check.load(std::memory_order_relaxed);
+			if ((check ^ data) != key || opcode(data) != op || depth_of(data) < depth || generation(data) != gen) continue;
+			value = value_of(data);
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * store the value of an afterstate searched with the given depth
+	 */
+	void store(const board& after, unsigned op, unsigned depth, float value) {
+		board::data key;
+		canonicalize(after, op, key);
+		bucket& b = table[index(key, op)];
+		uint64_t data = pack(value, depth, op, age.load(std::memory_order_relaxed));
+		entry& keep = b.slot[0];
+		uint64_t old = keep.data.load(std::memory_order_relaxed);
+		bool replace = depth >= depth_of(old) || generation(old) != generation(data)
+			|| (keep.check.load(std::memory_order_relaxed) ^ old) == key;
+		entry& e = replace ? keep : b.slot[1];
+		e.check.store(key ^ data, std::memory_order_relaxed);
+		e.data.store(data, std::memory_order_relaxed);
+	}
+
+	/**
+	 * start a new generation (e.g., after the weights are updated), entries of older generations
+	 * are no longer returned and become replaceable
+	 */
+	void next_generation() { age.fetch_add(1, std::memory_order_relaxed); }
+
+	unsigned symmetry() const { return sym; }
+	size_t size() const { return table.size() * 2; }
+
+private:
+	/**
+	 * the smallest board among the symmetries, with the opcode mapped accordingly
+	 */
+	void canonicalize(const board& after, unsigned& op, board::data& key) const {
+		key = after.raw();
+		unsigned best = op;
+		for (unsigned f = 1; f < sym; f++) {
+			board b(after);
+			b.Flip_board(f);
+			if (b.raw() < key) {
+				key = b.raw();
+				best = opcode_decode_table[op][f];
+			}
+		}
+		op = best;
+	}
+
+	size_t index(board::data key, unsigned op) const {
+		uint64_t h = key ^ (uint64_t(op + 1) * 0x9e3779b97f4a7c15ull);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h >> shift;
+	}
+
+	/**
+	 * data layout: value (32 bits) | depth (8 bits) | generation (16 bits) | opcode (2 bits) | valid (1 bit),
+	 * the generation wraps around, but an entry would have to outlive 65536 updates to be mistaken as current
+	 */
+	static uint64_t pack(float value, unsigned depth, unsigned op, unsigned gen) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return (uint64_t(bits) << 32) | (uint64_t(std::min(depth, 255u)) << 24) | (uint64_t(gen & 0xffff) << 8) | ((op & 0b11) << 1) | 1;
+	}
+	static float value_of(uint64_t data) {
+		uint32_t bits = data >> 32;
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	static unsigned generation(uint64_t data) { return (data >> 8) & 0xffff; }
+	static unsigned depth_of(uint64_t data) { return (data & 1) ? (data >> 24) & 0xff : 0; }
+	static unsigned opcode(uint64_t data) { return (data & 1) ? (data >> 1) & 0b11 : -1u; }
+
+	struct entry {
+		std::atomic<uint64_t> check;
+		std::atomic<uint64_t> data;
+		entry() : check(0), data(0) {}
+	};
+	struct bucket {
+		entry slot[2];
+	};
+
+	unsigned shift;
+	unsigned sym;
+	std::atomic<unsigned> age;
+	std::vector<bucket> table;
+};
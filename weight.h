@@ -9,38 +9,488 @@
 
 #pragma once
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <array>
+#include <string>
+#include <memory>
 #include <utility>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 class weight {
 public:
-	weight() {}
-	weight(size_t len) : value(len,0) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
-	weight(const weight& f) = default;
+	/**
+	 * the element type of a table: float32 for training, float16 or int16 (scaled) for inference
+	 */
+	enum type : uint32_t { float32 = 0, float16 = 1, int16 = 2 };
 
-	weight& operator =(const weight& f) = default;
-	float& operator[] (size_t i) { return value[i]; }
-	const float& operator[] (size_t i) const { return value[i]; }
-	size_t size() const { return value.size(); }
+	/**
+	 * the pages backing owned tables: regular pages, transparent huge pages (madvise),
+	 * or explicit hugetlb pages (falling back to transparent ones if none are reserved)
+	 * tables of at least 2 MB are 2 MB-aligned; prefault touches every page at allocation
+	 */
+	enum paging { normal, transparent, hugetlb };
+	struct storage {
+		paging pages;
+		bool prefault;
+	};
+	static storage& backend() {
+		static storage config = { transparent, false };
+		return config;
+	}
+	static paging parse_paging(const std::string& name) {
+		if (name == "4k" || name == "normal") return normal;
+		if (name == "thp" || name == "transparent") return transparent;
+		if (name == "hugetlb") return hugetlb;
+		throw std::invalid_argument("unknown paging: " + name);
+	}
+
+	/**
+	 * the temporal coherence of an entry: the sum of its updates and the sum of their magnitudes
+	 */
+	struct coherence {
+		float error;
+		float absolute;
+	};
+	/**
+	 * an entry of a tracked table, whose coherence is in the same cache line as its value, so an
+	 * update touches one line; 16 bytes, so that a cell never straddles two lines and the coherence
+	 * is an aligned 8-byte word
+	 */
+	struct cell {
+		float value;
+		float spare;
+		coherence tc;
+	};
+
+public:
+	weight() : value(nullptr), length(0), dtype(float32), scale(1), shift(0) {}
+	weight(size_t len) : value(nullptr) { allocate(len, float32); }
+	/**
+	 * a view of a table which lives elsewhere (e.g., in a mapped weight file), kept alive by hold,
+	 * whose entries are cells if it is tracked
+	 */
+	weight(void* view, size_t len, std::shared_ptr<void> hold, type dtype = float32, float scale = 1, bool tracked = false)
+		: value(view), length(len), dtype(dtype), scale(scale), shift(tracked ? 2 : 0), hold(hold) {}
+	weight(weight&& f) noexcept : value(f.value), length(f.length), dtype(f.dtype), scale(f.scale), shift(f.shift), hold(std::move(f.hold)) {}
+	weight(const weight& f) : value(nullptr), length(0) { operator =(f); }
+
+	weight& operator =(const weight& f) {
+		if (this == &f) return *this;
+		allocate(f.length, f.dtype, f.tracked());
+		std::memcpy(value, f.value, f.bytes());
+		scale = f.scale;
+		return *this;
+	}
+	weight& operator =(weight&& f) noexcept {
+		value = f.value;
+		length = f.length;
+		dtype = f.dtype;
+		scale = f.scale;
+		shift = f.shift;
+		hold = std::move(f.hold);
+		return *this;
+	}
+	float& operator[] (size_t i) { return data()[i << shift]; }
+	const float& operator[] (size_t i) const { return data()[i << shift]; }
+	void prefetch(size_t i) const { __builtin_prefetch(static_cast<const char*>(value) + (dtype == float32 ? (i << shift) * sizeof(float) : i * sizeof(uint16_t))); }
+	size_t size() const { return length; }
+	/**
+	 * the entries as floats, entry i is at (i << stride()) (float32 only)
+	 */
+	float* data() { return static_cast<float*>(value); }
+	const float* data() const { return static_cast<const float*>(value); }
+	unsigned stride() const { return shift; }
+
+	type element() const { return dtype; }
+	float unit() const { return scale; }
+	const void* raw() const { return value; }
+	size_t bytes() const { return length * (dtype == float32 ? sizeof(float) << shift : sizeof(uint16_t)); }
+
+	/**
+	 * read an entry of any element type
+	 */
+	float get(size_t i) const {
+		switch (dtype) {
+		default:
+		case float32: return data()[i << shift];
+		case float16: return half_to_float(static_cast<const uint16_t*>(value)[i]);
+		case int16: return static_cast<const int16_t*>(value)[i] * scale;
+		}
+	}
+
+	/**
+	 * lock-free (Hogwild) update, concurrent updates of an entry may be lost but never torn
+	 */
+	void add(size_t i, float d) {
+		float* at = &data()[i << shift];
+		float v;
+		__atomic_load(at, &v, __ATOMIC_RELAXED);
+		v += d;
+		__atomic_store(at, &v, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * a TD update of an entry, which is scaled by the coherence |sum of updates| / sum of |updates|
+	 * of the entry if it is tracked (temporal coherence learning); the coherence is the same
+	 * for the errors and for the steps of a constant learning rate, so the steps are accumulated
+	 */
+	void learn(size_t i, float d) {
+		if (!shift) return add(i, d);
+		coherence& tc = static_cast<cell*>(value)[i].tc;
+		coherence c;
+		__atomic_load(&tc, &c, __ATOMIC_RELAXED);
+		add(i, c.absolute > 0 ? d * std::abs(c.error) / c.absolute : d);
+		c.error += d;
+		c.absolute += std::abs(d);
+		__atomic_store(&tc, &c, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * track the temporal coherence of every entry (of a float32 table), which turns the entries into
+	 * cells whose coherence starts from zero
+	 */
+	void track() {
+		if (dtype != float32 || tracked()) return;
+		weight cells;
+		cells.allocate(length, float32, true);
+		for (size_t i = 0; i < length; i++) cells[i] = data()[i];
+		cells.scale = scale;
+		*this = std::move(cells);
+	}
+	bool tracked() const { return shift; }
+
+	/**
+	 * convert to another element type, int16 is scaled so that the largest magnitude maps to 32767
+	 */
+	weight quantize(type to) const {
+		weight q;
+		q.allocate(length, to);
+		float peak = 0;
+		for (size_t i = 0; i < length; i++) peak = std::max(peak, std::abs(get(i)));
+		q.scale = (to == int16 && peak > 0) ? peak / 32767 : 1;
+		for (size_t i = 0; i < length; i++) {
+			float v = get(i);
+			switch (to) {
+			default:
+			case float32: q.data()[i] = v; break;
+			case float16: static_cast<uint16_t*>(q.value)[i] = float_to_half(v); break;
+			case int16: static_cast<int16_t*>(q.value)[i] = int16_t(std::lround(v / q.scale)); break;
+			}
+		}
+		return q;
+	}
+
+	static type parse(const std::string& name) {
+		if (name == "fp16" || name == "float16") return float16;
+		if (name == "int16") return int16;
+		if (name == "fp32" || name == "float32") return float32;
+		throw std::invalid_argument("unknown element type: " + name);
+	}
+
+	/**
+	 * IEEE 754 half precision conversions (round to nearest even), for tables and the scalar path
+	 */
+	static uint16_t float_to_half(float f) {
+		uint32_t x;
+		std::memcpy(&x, &f, sizeof(x));
+		uint32_t sign = (x >> 16) & 0x8000;
+		int32_t exp = int32_t((x >> 23) & 0xff) - 127 + 15;
+		uint32_t mant = x & 0x7fffff;
+		if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0); // inf or nan
+		if (exp >= 31) return sign | 0x7c00; // overflow
+		if (exp <= 0) { // subnormal or zero
+			if (exp < -10) return sign;
+			mant |= 0x800000;
+			uint32_t shift = 14 - exp;
+			uint32_t half = mant >> shift, rest = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+			if (rest > mid || (rest == mid && (half & 1))) half++;
+			return sign | half;
+		}
+		uint32_t half = (exp << 10) | (mant >> 13), rest = mant & 0x1fff;
+		if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+		return sign | half;
+	}
+	static float half_to_float(uint16_t h) {
+		uint32_t sign = uint32_t(h & 0x8000) << 16;
+		uint32_t exp = (h >> 10) & 0x1f;
+		uint32_t mant = h & 0x3ff;
+		uint32_t x;
+		if (exp == 0x1f) x = sign | 0x7f800000 | (mant << 13);
+		else if (exp) x = sign | ((exp + 112) << 23) | (mant << 13);
+		else if (mant) { // subnormal
+			exp = 113;
+			while (!(mant & 0x400)) mant <<= 1, exp--;
+			x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+		}
+		else x = sign;
+		float f;
+		std::memcpy(&f, &x, sizeof(f));
+		return f;
+	}
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-		auto& value = w.value;
-		uint64_t size = value.size();
+		uint64_t size = w.length;
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(float) * size);
+		if (!w.tracked()) return out.write(reinterpret_cast<const char*>(w.value), sizeof(float) * size);
+		for (size_t i = 0; i < size; i++) out.write(reinterpret_cast<const char*>(&w[i]), sizeof(float));
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, weight& w) {
-		auto& value = w.value;
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(float) * size);
+		w.allocate(size, float32);
+		in.read(reinterpret_cast<char*>(w.value), sizeof(float) * size);
 		return in;
 	}
 
 protected:
-	std::vector<float> value;
+	/**
+	 * own a zeroed table (of cells if tracked), with one spare word so that 16-bit entries
+	 * can be gathered as 32-bit words
+	 */
+	void allocate(size_t len, type t, bool tracked = false) {
+		length = len;
+		dtype = t;
+		scale = 1;
+		shift = tracked ? 2 : 0;
+		hold = reserve(bytes() + sizeof(float), value);
+	}
+
+	/**
+	 * map anonymous zeroed memory as configured by backend()
+	 */
+	static std::shared_ptr<void> reserve(size_t need, void*& addr) {
+		const size_t huge = size_t(2) << 20, page = 4096;
+		const storage& config = backend();
+		bool large = need >= huge;
+		size_t size = large ? (need + huge - 1) & ~(huge - 1) : (need + page - 1) & ~(page - 1);
+		size_t mapped = size;
+		void* base = MAP_FAILED;
+		if (config.pages == hugetlb && large)
+			base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (config.prefault ? MAP_POPULATE : 0), -1, 0);
+		if (base != MAP_FAILED) {
+			addr = base;
+		} else {
+			mapped = large ? size + huge : size; // over-map to align the table at 2 MB
+			base = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base == MAP_FAILED) throw std::bad_alloc();
+			uintptr_t head = reinterpret_cast<uintptr_t>(base);
+			addr = reinterpret_cast<void*>(large ? (head + huge - 1) & ~(huge - 1) : head);
+			if (large && config.pages != normal) ::madvise(addr, size, MADV_HUGEPAGE);
+			if (config.prefault)
+				for (size_t i = 0; i < size; i += page) static_cast<volatile char*>(addr)[i] = 0;
+		}
+		return std::shared_ptr<void>(base, [mapped](void* base) { ::munmap(base, mapped); });
+	}
+
+	void* value;
+	size_t length;
+	type dtype;
+	float scale;
+	unsigned shift; // entry i is at float (i << shift): 0, or 2 if the entries are cells (tracked)
+	std::shared_ptr<void> hold;
+};
+
+/**
+ * the cells read by an n-tuple, pos[0] is the most significant nibble of its index
+ */
+struct ntuple {
+	uint32_t table;
+	uint32_t length;
+	std::array<int8_t, 8> pos;
+
+	bool operator ==(const ntuple& t) const {
+		return table == t.table && length == t.length && std::equal(pos.begin(), pos.begin() + length, t.pos.begin());
+	}
+	bool operator !=(const ntuple& t) const { return !(*this == t); }
+};
+
+/**
+ * versioned weight file
+ *
+ * layout: header | table directory | tuple layout | padding | tables
+ * every table starts on a page boundary and is stored as a raw array of its element type,
+ * or of weight::cell if it is tracked, so the file can be mapped and used in place;
+ * processes which map the same file share its physical pages until they write to them (copy-on-write)
+ * the checksum covers the table data (with the cells of the tracked tables)
+ */
+class weight_file {
+public:
+	static constexpr uint32_t version = 1;
+	static constexpr uint64_t page = 4096;
+
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t iso;       // number of isomorphisms, or 0 for the fixed network
+		uint32_t tables;
+		uint32_t tuples;
+		uint64_t checksum;
+	};
+	struct table {
+		uint64_t offset;
+		uint64_t size;     // number of entries
+		uint32_t dtype;    // weight::type
+		float scale;       // of int16 entries
+		uint32_t cells;    // 1 if the entries are weight::cell (tracked), 0 if they are of dtype
+		uint32_t reserved;
+	};
+
+public:
+	static bool is(const std::string& path) {
+		char magic[8] = {};
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		in.read(magic, sizeof(magic));
+		return in && std::memcmp(magic, signature(), sizeof(magic)) == 0;
+	}
+
+	/**
+	 * the layout of a weight file for a network, prepared in advance so that writing it only takes
+	 * system calls, which is all a child forked from a multithreaded process may safely do
+	 */
+	class image {
+	public:
+		image(const std::string& path, const std::vector<weight>& net, uint32_t iso, const std::vector<ntuple>& tuples)
+			: path(path), temp(path + ".tmp"), net(net), head(sizeof(header) + sizeof(table) * net.size() + sizeof(ntuple) * tuples.size()) {
+			header h = {};
+			std::memcpy(h.magic, signature(), sizeof(h.magic));
+			h.version = version;
+			h.iso = iso;
+			h.tables = net.size();
+			h.tuples = tuples.size();
+			std::vector<table> dir(net.size());
+			length = align(head.size());
+			for (size_t i = 0; i < net.size(); i++) {
+				dir[i] = { length, net[i].size(), net[i].element(), net[i].unit(), net[i].tracked(), 0 };
+				length = align(length + net[i].bytes() + sizeof(float)); // keep a spare word after each table
+			}
+			std::memcpy(&head[0], &h, sizeof(h));
+			std::memcpy(&head[sizeof(h)], dir.data(), sizeof(table) * dir.size());
+			std::memcpy(&head[sizeof(h) + sizeof(table) * dir.size()], tuples.data(), sizeof(ntuple) * tuples.size());
+			for (size_t i = 0; i < net.size(); i++)
+				parts.push_back({ net[i].raw(), net[i].bytes(), dir[i].offset });
+		}
+
+		/**
+		 * write the tables as they are now to a temporary file and rename it, so that a mapping of
+		 * the old file stays valid; the padding is left as holes, which read as zeros
+		 */
+		bool write() {
+			header& h = *reinterpret_cast<header*>(&head[0]);
+			h.checksum = checksum(net);
+			int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) return false;
+			bool done = put(fd, head.data(), head.size(), 0);
+			for (const part& p : parts) done = done && put(fd, p.data, p.bytes, p.offset);
+			done = done && ::ftruncate(fd, length) == 0;
+			done = ::close(fd) == 0 && done;
+			return done && ::rename(temp.c_str(), path.c_str()) == 0;
+		}
+
+	private:
+		struct part {
+			const void* data;
+			uint64_t bytes;
+			uint64_t offset;
+		};
+
+		static bool put(int fd, const void* data, uint64_t bytes, uint64_t offset) {
+			const char* from = static_cast<const char*>(data);
+			while (bytes) {
+				ssize_t n = ::pwrite(fd, from, bytes, offset);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) return false;
+				from += n, bytes -= n, offset += n;
+			}
+			return true;
+		}
+
+		std::string path, temp;
+		const std::vector<weight>& net;
+		std::vector<char> head; // header | table directory | tuple layout
+		std::vector<part> parts;
+		uint64_t length;
+	};
+
+	/**
+	 * write to a temporary file and rename it, so that a mapping of the old file stays valid
+	 */
+	static void save(const std::string& path, const std::vector<weight>& net, uint32_t iso, const std::vector<ntuple>& tuples) {
+		if (!image(path, net, iso, tuples).write()) throw std::runtime_error("cannot write " + path);
+	}
+
+	/**
+	 * map a weight file, the returned tables are views into the mapping
+	 */
+	static std::vector<weight> map(const std::string& path, uint32_t& iso, std::vector<ntuple>& tuples, bool verify = false) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("cannot open " + path);
+		struct stat st;
+		void* addr = ::fstat(fd, &st) == 0 ? ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (weight::backend().prefault ? MAP_POPULATE : 0), fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+		size_t length = st.st_size;
+		std::shared_ptr<void> hold(addr, [length](void* addr) { ::munmap(addr, length); });
+
+		char* base = static_cast<char*>(addr);
+		header head;
+		if (length < sizeof(head)) throw std::runtime_error("truncated weight file " + path);
+		std::memcpy(&head, base, sizeof(head));
+		if (std::memcmp(head.magic, signature(), sizeof(head.magic)) != 0 || head.version != version)
+			throw std::runtime_error("unsupported weight file " + path);
+		if (sizeof(header) + sizeof(table) * head.tables + sizeof(ntuple) * head.tuples > length)
+			throw std::runtime_error("truncated weight file " + path);
+		std::vector<table> dir(head.tables);
+		std::memcpy(dir.data(), base + sizeof(header), sizeof(table) * dir.size());
+		tuples.resize(head.tuples);
+		std::memcpy(tuples.data(), base + sizeof(header) + sizeof(table) * dir.size(), sizeof(ntuple) * tuples.size());
+		iso = head.iso;
+		for (const ntuple& t : tuples) { // the tuples index the tables, so a bad record would read out of bounds
+			bool valid = t.length >= 1 && t.length <= 6 && t.table < dir.size() && dir[t.table].size >= uint64_t(1) << (4 * t.length);
+			for (uint32_t i = 0; valid && i < t.length; i++) valid = t.pos[i] >= 0 && t.pos[i] < 16;
+			if (!valid) throw std::runtime_error("corrupted weight file " + path);
+		}
+
+		std::vector<weight> net;
+		for (const table& t : dir) {
+			if (t.dtype > weight::int16) throw std::runtime_error("unsupported weight file " + path);
+			weight::type dtype = weight::type(t.dtype);
+			size_t bytes = t.size * (t.cells ? sizeof(weight::cell) : dtype == weight::float32 ? sizeof(float) : sizeof(uint16_t));
+			if (t.offset % page || t.offset + bytes + sizeof(float) > length || t.cells > 1 || (t.cells && dtype != weight::float32)) // with the spare word
+				throw std::runtime_error("corrupted weight file " + path);
+			net.emplace_back(base + t.offset, t.size, hold, dtype, t.scale, t.cells);
+		}
+		if (verify && checksum(net) != head.checksum)
+			throw std::runtime_error("checksum mismatch in " + path);
+		return net;
+	}
+
+	/**
+	 * 64-bit FNV-1a over the table data, one 32-bit word at a time
+	 */
+	static uint64_t checksum(const std::vector<weight>& net) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (const weight& w : net) {
+			const uint32_t* word = static_cast<const uint32_t*>(w.raw());
+			for (size_t i = 0; i < w.bytes() / sizeof(uint32_t); i++) hash = (hash ^ word[i]) * 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+private:
+	static const char* signature() { return "THREESW\x01"; }
+	static uint64_t align(uint64_t offset) { return (offset + page - 1) / page * page; }
 };